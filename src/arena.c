@@ -23,7 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#define ALIGN_UP_POW2(n, p) (((n) * ((p) - 1)) & (~((p) - 1)))
+#define ALIGN_UP_POW2(n, p) (((n) + ((p) - 1)) & (~((p) - 1)))
 
 #define CLAMP_TOP(a, max) MIN(a, max)
 #define CLAMP_BOTTOM(a, min) MAX(a, min)
@@ -95,11 +95,11 @@ void os_memory_commit(void *ptr, size_t size)
 {
 #if HAS_LINUX
     int res = mprotect(ptr, size, PROT_READ | PROT_WRITE);
-    if (res == 1) {
+    if (res != 0) {
         FAIL_MESSAGE("mprotect failed to commit memory: %s", strerror(errno));
     }
 #elif HAS_WINDOWS
-    VirtualAlloc(ptr, size, MEM_COMMIT, MEM_READWRITE);
+    VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE);
 #else
 #error "Unsupported OS for committing memory"
 #endif
@@ -154,7 +154,9 @@ Arena* arena_alloc_from_config(Arena_Config* config)
     }
 
     Arena *arena = (Arena *) base;
+    arena->prev = NULL;
     arena->current = arena; // Pointer to itself
+    arena->flags = config->flags;
     arena->committed_size = commit_size;
     arena->reserved_size = reserve_size;
     arena->base_position = 0;
@@ -183,6 +185,12 @@ Arena* arena_alloc(void)
 
 void arena_release(Arena* self)
 {
+    // Blocks that were popped off and are waiting to be reused
+    for (Arena *n = self->free_last, *prev = NULL; n != NULL; n = prev) {
+        prev = n->prev;
+        os_memory_release(n, n->reserved_pos);
+    }
+
     for (Arena *n = self->current, *prev = NULL; n != NULL; n = prev) {
         prev = n->prev;
         os_memory_release(n, n->reserved_pos);
@@ -212,8 +220,8 @@ void* arena_push(Arena *self, uint64_t size, uint64_t align)
         Arena *prev_block;
 
         for (new_block = self->free_last, prev_block = NULL; new_block != NULL; prev_block = new_block, new_block = new_block->prev) {
-            if (new_block->reserved_pos >= ALIGN_UP_POW2(size, align)) {
-                if (!prev_block) {
+            if (new_block->reserved_pos >= ALIGN_UP_POW2(size + ARENA_HEADER_MAX_SIZE, align)) {
+                if (prev_block) {
                     prev_block->prev = new_block->prev;
                 } else {
                     self->free_last = new_block->prev;
@@ -233,14 +241,14 @@ void* arena_push(Arena *self, uint64_t size, uint64_t align)
             if (size + ARENA_HEADER_MAX_SIZE > reserved_size) {
                 reserved_size = ALIGN_UP_POW2(size + ARENA_HEADER_MAX_SIZE, align);
                 commit_size = ALIGN_UP_POW2(size + ARENA_HEADER_MAX_SIZE, align);
-
-                Arena_Config config = {
-                    .reserve_size = reserved_size,
-                    .commit_size = commit_size,
-                    .flags = ARENA_FLAG_NONE,
-                };
-                new_block = arena_alloc_from_config(&config);
             }
+
+            Arena_Config config = {
+                .reserve_size = reserved_size,
+                .commit_size = commit_size,
+                .flags = ARENA_FLAG_NONE,
+            };
+            new_block = arena_alloc_from_config(&config);
         }
 
         new_block->base_position = current->base_position + current->reserved_pos;
@@ -261,6 +269,7 @@ void* arena_push(Arena *self, uint64_t size, uint64_t align)
         uint8_t *commit_ptr = (uint8_t *) current + current->commit_pos;
 
         os_memory_commit(commit_ptr, commit_size);
+        current->commit_pos = commit_post_clamped;
     }
 
     // Push unto current block
@@ -335,6 +344,7 @@ void arena_pop_to(Arena *self, uint64_t position)
         current->position = ARENA_HEADER_MAX_SIZE;
         self->free_size += current->reserved_size;
         current->prev = self->free_last;
+        self->free_last = current;
 
         // Poison memory region
     }
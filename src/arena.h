@@ -113,6 +113,36 @@ extern "C" {
 #error "Unsupported compiler!"
 #endif
 
+///////////////////////////////////////////////////////////////////////////////
+// Atomics (on 32-bit integers, and loads/stores of pointers)
+// Loads acquire, stores release, the rest are full barriers.
+///////////////////////////////////////////////////////////////////////////////
+
+#if HAS_MSVC
+#include <intrin.h>
+#define ATOMIC_LOAD_32(p) ((uint32_t) _InterlockedOr((volatile long *) (p), 0))
+#define ATOMIC_STORE_32(p, v) ((void) _InterlockedExchange((volatile long *) (p), (long) (v)))
+// Returns the old value
+#define ATOMIC_ADD_32(p, v) ((uint32_t) _InterlockedExchangeAdd((volatile long *) (p), (long) (v)))
+// Returns true if *p was equal to expected and got replaced with desired
+#define ATOMIC_CAS_32(p, expected, desired) \
+    ((uint32_t) _InterlockedCompareExchange((volatile long *) (p), (long) (desired), (long) (expected)) == (uint32_t) (expected))
+// Loads give back a void*, cast it
+#define ATOMIC_LOAD_PTR(p) _InterlockedCompareExchangePointer((void * volatile *) (p), NULL, NULL)
+#define ATOMIC_STORE_PTR(p, v) ((void) _InterlockedExchangePointer((void * volatile *) (p), (void *) (v)))
+#elif HAS_CLANG || HAS_GCC || HAS_TCC
+#define ATOMIC_LOAD_32(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_32(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_ADD_32(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_CAS_32(p, expected, desired) \
+    ({ uint32_t _expected = (expected); \
+       __atomic_compare_exchange_n((p), &_expected, (desired), 0, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE); })
+#define ATOMIC_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_PTR(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#error "Unsupported compiler!"
+#endif
+
 
 
 ///////////////////////////////////////////////////////////////////////////////
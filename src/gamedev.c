@@ -1,6 +1,7 @@
 #include "gamedev.h"
 #include "arena.h"
 #include "object_pool.h"
+#include "jobs.h"
 
 #include <stddef.h>
 #include <stdio.h>
@@ -8,10 +9,16 @@
 #include <time.h>
 #include <string.h>
 
-const char *g_scene_name;
+#if HAS_WINDOWS
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
 
-static bool _should_switch_scene;
-static char _new_scene_name[32];
+const char *g_scene_name;
+Scene_Id g_scene_id;
+void *g_scene_data;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Timing system (needs while loop to poll)
@@ -19,25 +26,93 @@ static char _new_scene_name[32];
 
 void time_init(Timing_System *self)
 {
-    if (!self) {
+    time_init_sz(self, TIME_DEFAULT_CAPACITY);
+}
+
+void time_init_sz(Timing_System *self, size_t capacity)
+{
+    if (!self || capacity == 0) {
         return;
     }
 
-    self->pool = (Timed_Task *) malloc(sizeof(Timed_Task) * 300);
+    self->pool = (Timed_Task *) calloc(capacity, sizeof(Timed_Task));
     if (!self->pool) {
         FAIL_MESSAGE("Failed to allocate object pool!");
     }
 
     //self->head = NULL;
-    objpool_init(self, 300);
+    objpool_init(self, (int) capacity);
+    self->count = 0;
+    self->high_water = 0;
+
+    self->jobs = NULL;
+    self->batch = NULL;
+    self->parallel_min = 0;
+
+    self->payload_arena = NULL;
+    memset(self->payload_free, 0, sizeof(self->payload_free));
 }
 
+void time_set_job_system(Timing_System *self, Job_System *jobs, size_t min_batch)
+{
+    self->jobs = jobs;
+    self->parallel_min = min_batch;
 
-Timed_Task* time_schedule(Timing_System *self, float delay, Task_Consumer cons)
+    if (jobs && !self->batch) {
+        self->batch = (Timed_Task **) malloc(sizeof(Timed_Task *) * self->capacity);
+        if (!self->batch) {
+            FAIL_MESSAGE("Failed to allocate the due task batch!");
+        }
+    }
+}
+
+void time_deinit(Timing_System *self)
+{
+    if (!self) {
+        return;
+    }
+
+    free(self->batch);
+    self->batch = NULL;
+    self->jobs = NULL;
+
+    // Takes every big payload with it
+    if (self->payload_arena) {
+        arena_release(self->payload_arena);
+        self->payload_arena = NULL;
+    }
+    memset(self->payload_free, 0, sizeof(self->payload_free));
+
+    free(self->pool);
+    self->pool = NULL;
+    self->free_list = NULL;
+    self->count = self->capacity = self->high_water = 0;
+}
+
+
+static Timed_Task* time_new_task(Timing_System *self)
 {
+    if (!self->free_list) {
+        FAIL_MESSAGE("Timing system ran out of task slots (capacity %zu)", self->capacity);
+    }
+
     Timed_Task *new_task;
     objpool_add(self, new_task);
 
+    size_t slot = (size_t) (new_task - self->pool) + 1;
+    if (slot > self->high_water) {
+        self->high_water = slot;
+    }
+
+    memset(new_task, 0, sizeof(*new_task));
+    new_task->in_use = true;
+    return new_task;
+}
+
+Timed_Task* time_schedule(Timing_System *self, float delay, Task_Consumer cons)
+{
+    Timed_Task *new_task = time_new_task(self);
+
     float current_time = time_time();
 
     new_task->cons = cons;
@@ -47,492 +122,4198 @@ Timed_Task* time_schedule(Timing_System *self, float delay, Task_Consumer cons)
     return new_task;
 }
 
-void time_run_due_tasks(Timing_System *self)
+Timed_Task* time_schedule_arg(Timing_System *self, float delay, Task_Consumer_Arg cons, void *arg)
 {
-    float current_time = time_time();
+    Timed_Task *new_task = time_schedule(self, delay, NULL);
+    time_task_set_arg(new_task, cons, arg);
+    return new_task;
+}
 
-    size_t count = self->count;
-    for (int i = 0; i < self->count; ++i) {
-        Timed_Task *current = &self->pool[i];
-        if (current->snapshot <= current_time) {
-            current->cons();
+Timed_Task* time_schedule_payload(Timing_System *self, float delay,
+    Task_Consumer_Arg cons, const void *payload, size_t size)
+{
+    Timed_Task *new_task = time_schedule(self, delay, NULL);
+    time_task_set_payload(self, new_task, cons, payload, size);
+    return new_task;
+}
 
-            objpool_remove(self, current);
-        }
+Timed_Task* time_schedule_periodic(Timing_System *self,
+    float initial_delay, float interval, unsigned int count, Task_Consumer cons)
+{
+    if (count == 0 || interval < 0) {
+        return NULL;
     }
-    printf("%zu\n", count);
-}
 
+    Timed_Task *task = time_schedule(self, initial_delay, cons);
+    task->scheduled = task->snapshot;
+    task->periodic = true;
+    task->interval = interval;
+    task->repeats_left = count;
+    task->catch_up = TIME_CATCH_UP_SKIP;
 
+    return task;
+}
 
-void time_repeat_delayed(Timing_System *self,
+Timed_Task* time_repeat_delayed(Timing_System *self,
     float initial_delay, float interval, unsigned int count, Task_Consumer cons)
 {
-    for (int i = 0; i < count; ++i) {
-        time_schedule(self, initial_delay + interval * i, cons);
-    }
+    return time_schedule_periodic(self, initial_delay, interval, count, cons);
 }
 
-float time_time(void)
+void time_task_set_jitter(Timed_Task *task, float jitter)
 {
-    return time(NULL);
+    task->jitter = (jitter > 0) ? jitter : 0;
 }
 
+void time_task_set_catch_up(Timed_Task *task, Time_Catch_Up policy)
+{
+    task->catch_up = policy;
+}
 
-///////////////////////////////////////////////////////////////////////////////
-// Event system
-///////////////////////////////////////////////////////////////////////////////
+void time_task_set_flags(Timed_Task *task, uint32_t flags)
+{
+    task->flags = flags;
+}
 
-void events_notify_update(Event_Callbacks *subscribers, Event_t *ev)
+void time_task_set_arg(Timed_Task *task, Task_Consumer_Arg cons, void *arg)
 {
-    for (unsigned int i = 0; i < subscribers->count; ++i) {
-        Event_Callback *callback = &subscribers->data[i];
-        callback->update(callback->arg);
+    task->cons_arg = cons;
+    task->arg = arg;
+    task->has_arg = true;
+}
+
+static unsigned int time_payload_class(size_t size)
+{
+    unsigned int c = 0;
+    while (c < TIME_PAYLOAD_CLASSES && ((size_t) 1 << (c + TIME_PAYLOAD_BLOCK_SHIFT)) < size) {
+        c++;
     }
+    return c;
 }
 
-void events_notify_input(Event_Callbacks *subscribers, Event_t *ev)
+// The block stays in the arena, for the next payload of its size
+static void time_payload_free(Timing_System *self, Timed_Task *task)
 {
-    for (unsigned int i = 0; i < subscribers->count; ++i) {
-        Event_Callback *callback = &subscribers->data[i];
-        // Only call specific events this way
-        if (callback->type_mask & ev->type) {
-            callback->input(callback->arg, ev);
-        }
+    if (!task->big_payload) {
+        return;
     }
+    unsigned int c = time_payload_class(task->big_payload_capacity);
+    *(void **) task->big_payload = self->payload_free[c];
+    self->payload_free[c] = task->big_payload;
+    task->big_payload = NULL;
+    task->big_payload_capacity = 0;
 }
 
+static void time_payload_alloc(Timing_System *self, Timed_Task *task, size_t size)
+{
+    unsigned int c = time_payload_class(size);
+    if (c == TIME_PAYLOAD_CLASSES) {
+        FAIL_MESSAGE("Couldn't allocate a task payload of %zu bytes", size);
+    }
 
-///////////////////////////////////////////////////////////////////////////////
-// Scene system
-///////////////////////////////////////////////////////////////////////////////
+    void *block = self->payload_free[c];
+    if (block) {
+        self->payload_free[c] = *(void **) block;
+    } else {
+        if (!self->payload_arena) {
+            self->payload_arena = arena_alloc();
+        }
+        block = arena_push(self->payload_arena, (uint64_t) 1 << (c + TIME_PAYLOAD_BLOCK_SHIFT), 16);
+        if (!block) {
+            FAIL_MESSAGE("Couldn't allocate a task payload of %zu bytes", size);
+        }
+    }
+    task->big_payload = block;
+    task->big_payload_capacity = (size_t) 1 << (c + TIME_PAYLOAD_BLOCK_SHIFT);
+}
 
-void scene_switch(const char *to)
+void* time_task_set_payload(Timing_System *self, Timed_Task *task,
+    Task_Consumer_Arg cons, const void *payload, size_t size)
 {
-    strncpy(_new_scene_name, to, 32);
+    void *copy = task->payload.bytes;
+    if (size > TIME_TASK_PAYLOAD_SIZE) {
+        if (size > task->big_payload_capacity) {
+            time_payload_free(self, task);
+            time_payload_alloc(self, task, size);
+        }
+        copy = task->big_payload;
+    }
 
-    _should_switch_scene = true;
-    /*
-    if (_f_load_start) {
-        _f_load_start(loadArg);
+    if (size) {
+        memcpy(copy, payload, size);
     }
-    */
+    time_task_set_arg(task, cons, copy);
+    return copy;
 }
 
-// Deferred action
-static void scene_do_switch(void)
+void time_remove(Timing_System *self, Timed_Task *task)
 {
-Event_t ev;
-    if (!_should_switch_scene) {
+    if (!self || !task || !task->in_use) {
         return;
     }
 
-    if (g_scene_name) {
-        // End the previous scene
-        ev.type = EVENT_END_SCENE;
-        //events_notify_input(&inputHandlers, &ev, false);
+    task->in_use = false;
+    time_payload_free(self, task);
+    objpool_remove(self, task);
+
+    // Shrink the polled range when the top slots are free
+    while (self->high_water && !self->pool[self->high_water - 1].in_use) {
+        self->high_water--;
     }
-    // Something
+}
 
-    // Start the new scene
-    g_scene_name = _new_scene_name;
-    ev.type = EVENT_START_SCENE;
-    //events_notify_input(&inputHandlers, &ev, false);
 
-    _should_switch_scene = false;
+static inline void time_task_call(Timed_Task *task)
+{
+    if (task->has_arg) {
+        task->cons_arg(task->arg);
+    } else if (task->cons) {
+        task->cons();
+    }
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Entity component system (ECS)
-///////////////////////////////////////////////////////////////////////////////
+static inline float time_jitter(const Timed_Task *task)
+{
+    if (task->jitter <= 0) {
+        return 0;
+    }
+    return task->jitter * ((float) rand() / (float) RAND_MAX);
+}
 
-#define DENSE_PAGE_SIZE 1024
-#define DENSE_PAGE_LIST_SIZE (MAX_ENTITIES / DENSE_PAGE_SIZE)
-#define SPARSE_NONE ((Idx_t)-1)
+// Returns false if the task is done and should go back to the pool
+static bool time_reschedule(Timed_Task *task, float current_time)
+{
+    if (!task->periodic) {
+        return false;
+    }
 
-typedef struct Component_List {
-    bool initialized;
+    if (task->repeats_left != TIME_REPEAT_FOREVER && --task->repeats_left == 0) {
+        return false;
+    }
 
-    // Flags
-    bool no_purge;
-    bool deleted_component;
-    bool keep_ordering;
+    // Keep a steady cadence, instead of drifting by however late the poll was
+    task->scheduled += task->interval;
+    if (task->catch_up == TIME_CATCH_UP_SKIP && task->scheduled <= current_time) {
+        task->scheduled = current_time + task->interval;
+    }
+    task->snapshot = task->scheduled + time_jitter(task);
 
-    unsigned int component_size;
-    unsigned int count;
-    unsigned int n_dense_pages;
+    return true;
+}
 
-    // Create/delete notifier
-    //void *arg;
+// Runs one task on the calling thread, and puts it back into the pool
+// when it's done
+static void time_run_task(Timing_System *self, Timed_Task *task, float current_time)
+{
+    bool alive = true;
+    while (alive && task->snapshot <= current_time) {
+        time_task_call(task);
+        if (!task->in_use) {
+            // The task removed itself
+            return;
+        }
 
-    Idx_t *sparse;
-    void *dense[DENSE_PAGE_LIST_SIZE];
-} Component_List;
+        alive = time_reschedule(task, current_time);
+        // With no interval it'd never catch up, so once per poll, like
+        // time_due_runs() counts it
+        if (task->catch_up != TIME_CATCH_UP_ALL || task->interval <= 0) {
+            break;
+        }
+    }
 
-Component_List component_lists[MAX_COMPONENT_LISTS];
+    if (!alive) {
+        time_remove(self, task);
+    }
+}
 
-uint32_t first_free_entity;
-Entity_t entity_list[MAX_ENTITIES];
-uint64_t entity_component_lists[MAX_ENTITIES * 2];
+// How many times a due task has to run in this poll
+static unsigned int time_due_runs(const Timed_Task *task, float current_time)
+{
+    if (task->snapshot > current_time) {
+        return 0;
+    }
+    if (!task->periodic || task->catch_up != TIME_CATCH_UP_ALL || task->interval <= 0) {
+        return 1;
+    }
 
+    unsigned int runs = (unsigned int) ((current_time - task->snapshot) / task->interval) + 1;
+    if (task->repeats_left != TIME_REPEAT_FOREVER && runs > task->repeats_left) {
+        runs = task->repeats_left;
+    }
+    return runs;
+}
 
-void ecs_cl_init_sz(int id, unsigned int element_size)
+static void time_run_batch(void *arg, uint32_t begin, uint32_t end)
 {
-    Component_List *cl = &component_lists[id];
-    
-    // Set to 0
-    memset(cl, 0, sizeof(*cl));
+    Timing_System *self = (Timing_System *) arg;
+    for (uint32_t i = begin; i < end; ++i) {
+        Timed_Task *task = self->batch[i];
+        for (unsigned int r = 0; r < task->due_runs; ++r) {
+            time_task_call(task);
+        }
+    }
+}
 
-    cl->initialized = true;
- cl->component_size = element_size;
+void time_run_due_tasks(Timing_System *self)
+{
+    float current_time = time_time();
 
-    cl->sparse = (Idx_t *) malloc(sizeof(Idx_t) * MAX_ENTITIES);
-    if (!cl->sparse) {
-        FAIL_MESSAGE("Couldn't allocate memory for sparse component list");
+    if (!self->jobs) {
+        for (size_t i = 0; i < self->high_water; ++i) {
+            Timed_Task *current = &self->pool[i];
+            if (current->in_use) {
+                time_run_task(self, current, current_time);
+            }
+        }
+        return;
     }
 
-    for (unsigned int i = 0; i < MAX_ENTITIES; ++i) {
-        cl->sparse[i] = SPARSE_NONE;
+    // Collect the due tasks that are allowed to leave the main thread
+    uint32_t batch_count = 0;
+    for (size_t i = 0; i < self->high_water; ++i) {
+        Timed_Task *current = &self->pool[i];
+        if (!current->in_use || (current->flags & TIME_TASK_MAIN_THREAD)) {
+            continue;
+        }
+
+        current->due_runs = time_due_runs(current, current_time);
+        if (current->due_runs) {
+            self->batch[batch_count++] = current;
+        }
     }
-    printf("New component list: (%d)\n", id);
-}
 
-void ecs_cl_deinit(int id)
-{
-    // Might have to use an internal arena for a component list.
+    if (batch_count >= self->parallel_min) {
+        jobs_parallel_for(self->jobs, batch_count, 0, time_run_batch, self);
+    } else {
+        time_run_batch(self, 0, batch_count);
+    }
 
-    Component_List *cl = &component_lists[id];
-    cl->initialized = false;
+    // Only the main thread touches the pool
+    for (uint32_t i = 0; i < batch_count; ++i) {
+        Timed_Task *task = self->batch[i];
+        bool alive = true;
+        for (unsigned int r = 0; alive && r < task->due_runs; ++r) {
+            alive = time_reschedule(task, current_time);
+        }
+        if (!alive) {
+            time_remove(self, task);
+        }
+    }
 
-    for (unsigned int i = 0; i < cl->n_dense_pages; ++i) {
-        free(cl->dense[i]);
+    for (size_t i = 0; i < self->high_water; ++i) {
+        Timed_Task *current = &self->pool[i];
+        if (current->in_use && (current->flags & TIME_TASK_MAIN_THREAD)) {
+            time_run_task(self, current, current_time);
+        }
     }
-    free(cl->sparse);
 }
 
-static inline Entity_t* ecs_dense_at(Component_List *cl, Idx_t idx)
+float time_time(void)
 {
-    return (Entity_t *) (
-        (char *) (cl->dense[idx / DENSE_PAGE_SIZE]) +
-        cl->component_size * (idx % DENSE_PAGE_SIZE)
-    );
+    // Seconds since the first call. An absolute timestamp doesn't fit in
+    // a float with any useful precision.
+#if HAS_WINDOWS
+    static LARGE_INTEGER start, frequency;
+    LARGE_INTEGER now;
+    if (!frequency.QuadPart) {
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&start);
+    }
+    QueryPerformanceCounter(&now);
+    return (float) ((double) (now.QuadPart - start.QuadPart) / (double) frequency.QuadPart);
+#else
+    static struct timespec start;
+    struct timespec now;
+    if (!start.tv_sec && !start.tv_nsec) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (float) ((double) (now.tv_sec - start.tv_sec) +
+                    (double) (now.tv_nsec - start.tv_nsec) * 1e-9);
+#endif
 }
 
 
-void* ecs_get_component_nullable(int id, Entity_t entity)
+///////////////////////////////////////////////////////////////////////////////
+// Event system
+///////////////////////////////////////////////////////////////////////////////
+
+static void events_apply_pending(Event_Callbacks *self);
+
+void events_notify_update(Event_Callbacks *subscribers, Event_t *ev)
 {
-    Component_List *cl = &component_lists[id];
-    Idx_t idx = cl->sparse[entity >> ENTITY_ID_SHIFT];
+    (void) ev;
 
-    if (idx != SPARSE_NONE) {
-        // If there is something in the sparse check,
-        // that means there is something dense.
-        Entity_t *e = ecs_dense_at(cl, idx);
-        if (entity == *e) {
-            return e;
+    subscribers->dispatch_depth++;
+    for (unsigned int i = 0; i < subscribers->count; ++i) {
+        Event_Callback *callback = &subscribers->data[i];
+        if (callback->update) {
+            callback->update(callback->arg);
         }
     }
-    return NULL;
-}
-void* ecs_get_component(int id, Entity_t entity)
-{
-    void *ret = ecs_get_component_nullable(id, entity);
-    if (!ret) {
-        FAIL_MESSAGE("Couldn't get the component at id (%d) from entity", id);
+    if (--subscribers->dispatch_depth == 0) {
+        events_apply_pending(subscribers);
     }
-    return ret;
 }
 
-void* ecs_new_component(int id, Entity_t entity)
+void events_notify_input(Event_Callbacks *subscribers, Event_t *ev)
 {
-    Component_List *cl = &component_lists[id];
-    if (!cl->initialized) {
-        FAIL_MESSAGE("Couldn't make a new component because the component list at index (%d) was not initialized!", id);
-    }
+    subscribers->dispatch_depth++;
+    if (subscribers->n_groups) {
+        // Whole groups either want this event or they don't
+        for (uint32_t g = 0; g < subscribers->n_groups; ++g) {
+            Event_Callback_Group *group = &subscribers->groups[g];
+            if (!(group->type_mask & ev->type)) {
+                continue;
+            }
 
-    Entity_t sparse_idx = entity >> ENTITY_ID_SHIFT;
-    Idx_t idx;
-    if (cl->sparse[sparse_idx] != SPARSE_NONE) {
-        // Overwrite component if it already exists
-        idx = cl->sparse[sparse_idx];
-        printf("Overwriting component %x in list %d\n", entity, id);
+            Event_Callback *callback = &subscribers->data[group->start];
+            for (uint32_t i = 0; i < group->count; ++i, ++callback) {
+                if (callback->input) {
+                    callback->input(callback->arg, ev);
+                }
+            }
+        }
     } else {
-        // We need to calculate the push index and place dense
-        // components at the corresponding location
-        idx = cl->count;
-        if (idx % DENSE_PAGE_SIZE == 0) {
-            size_t sz = (size_t) DENSE_PAGE_SIZE * cl->component_size;
-            char *dense = (char *) malloc(sz + 4);
-            if (!dense) {
-                FAIL_MESSAGE("Couldn't allocate dense memory block!");
+        for (unsigned int i = 0; i < subscribers->count; ++i) {
+            Event_Callback *callback = &subscribers->data[i];
+            // Only call specific events this way
+            if ((callback->type_mask & ev->type) && callback->input) {
+                callback->input(callback->arg, ev);
             }
-
-            // I love pointer arithmetic
-            *(Entity_t *)(dense + sz) = ((idx / DENSE_PAGE_SIZE) + 1) << ENTITY_ID_SHIFT;
-            cl->dense[idx / DENSE_PAGE_SIZE] = dense;
-            cl->n_dense_pages++;
         }
-        cl->count++;
     }
-    
-    void *result = ecs_dense_at(cl, idx);
-    memset(result, 0, cl->component_size);
-    *(Entity_t *) result = entity;
-    
-    entity_component_lists[sparse_idx*2 + id / 64] |= (1ULL << id % 64);
+    if (--subscribers->dispatch_depth == 0) {
+        events_apply_pending(subscribers);
+    }
+}
 
-    // We've now created the component
+void events_start_scene(void)
+{
+    Event_t ev = { EVENT_START_SCENE, 0, 0 };
+    events_notify_input(scene_handlers(), &ev);
+}
 
-    return result;
+void events_end_scene(void)
+{
+    Event_t ev = { EVENT_END_SCENE, 0, 0 };
+    events_notify_input(scene_handlers(), &ev);
 }
 
-static void ecs_unreg_entity(Entity_t entity);
-void ecs_remove_component(int id, Entity_t entity)
+///////////////////////////////////////////////////////////////////////////////
+// Subscriber registry
+//
+// Callbacks live in groups of the same type_mask, one group after another:
+// [group 0][group 1][group 2]...
+// Adding to (or removing from) a group shifts only one element per group
+// that comes after it, not the whole array.
+
+void events_callbacks_init(Event_Callbacks *self, struct Arena *arena)
 {
-    Component_List *cl = &component_lists[id];
-    Entity_t sparse_idx = entity >> ENTITY_ID_SHIFT;
-    Idx_t idx = cl->sparse[sparse_idx];
+    memset(self, 0, sizeof(*self));
+    self->arena = arena;
+}
 
-    if (idx == SPARSE_NONE) {
-        return;
+void events_callbacks_deinit(Event_Callbacks *self)
+{
+    if (self->owns_arena && self->arena) {
+        arena_release(self->arena);
     }
-    cl->sparse[sparse_idx] = SPARSE_NONE;
+    memset(self, 0, sizeof(*self));
+}
 
-    Entity_t *dst = ecs_dense_at(cl, idx);
-    if (entity != *dst) {
-        // Deleting an older version
-        return;
+// Grows an array inside the list's arena.
+// The old array stays in the arena until it gets cleared.
+static void* events_grow(Event_Callbacks *self, void *data, uint32_t *capacity,
+    uint32_t count, size_t element_size)
+{
+    if (!self->arena) {
+        self->arena = arena_alloc();
+        self->owns_arena = true;
     }
 
-    // Deletion
+    uint32_t new_capacity = *capacity ? *capacity * 2 : 8;
+    void *new_data = arena_push(self->arena, element_size * new_capacity, 16);
+    if (count) {
+        memcpy(new_data, data, element_size * count);
+    }
+    *capacity = new_capacity;
+    return new_data;
+}
 
-    if (cl->keep_ordering) {
-        *dst = 0;
-    } else {
-        cl->count -= 1;
-        if (idx != cl->count) {
-            // Do swap
-            Entity_t *src = ecs_dense_at(cl, cl->count);
-            memcpy(dst, src, cl->component_size);
-            Entity_t swapped = *dst;
-            cl->sparse[swapped >> ENTITY_ID_SHIFT] = idx;
-            *src = 0;
-        } else {
-            *dst = 0;
-        }
+static void events_insert(Event_Callbacks *self, const Event_Callback *callback)
+{
+    uint32_t g = 0;
+    while (g < self->n_groups && self->groups[g].type_mask != callback->type_mask) {
+        g++;
+    }
 
-        if (cl->count % DENSE_PAGE_SIZE == 0) {
-            uint32_t i = cl->count / DENSE_PAGE_SIZE;
-            free(cl->dense[i]);
-            cl->dense[i] = NULL;
-            cl->n_dense_pages--;
+    if (g == self->n_groups) {
+        if (self->n_groups >= self->groups_capacity) {
+            self->groups = (Event_Callback_Group *) events_grow(self, self->groups,
+                &self->groups_capacity, self->n_groups, sizeof(Event_Callback_Group));
         }
-        cl->deleted_component = true;
+        Event_Callback_Group *group = &self->groups[self->n_groups++];
+        group->type_mask = callback->type_mask;
+        group->start = self->count;
+        group->count = 0;
     }
 
-    entity_component_lists[sparse_idx*2 + id/64] &= ~(1ULL << id % 64);
-    if (!entity_component_lists[sparse_idx*2] &&
-        !entity_component_lists[sparse_idx*2 + 1]) {
-        // Remove this entity if it doesn't have any more components
-        ecs_unreg_entity(entity);
+    if (self->count >= self->capacity) {
+        self->data = (Event_Callback *) events_grow(self, self->data,
+            &self->capacity, self->count, sizeof(Event_Callback));
+    }
+
+    // Make a hole at the end of group g: every group after it moves its
+    // first callback to its end, starting from the last group
+    for (uint32_t h = self->n_groups - 1; h > g; --h) {
+        Event_Callback_Group *group = &self->groups[h];
+        if (group->count) {
+            self->data[group->start + group->count] = self->data[group->start];
+        }
+        group->start++;
     }
+
+    Event_Callback_Group *group = &self->groups[g];
+    self->data[group->start + group->count] = *callback;
+    group->count++;
+    self->count++;
 }
 
-void ecs_cl_ordered_clean(int id)
+static void events_remove_at(Event_Callbacks *self, uint32_t index)
 {
-    Component_List *cl = &component_lists[id];
-    
-    int src_idx, dst_idx;
-    src_idx = dst_idx = 0;
-    
-    for (unsigned int i = 0; i < cl->count; ++i) {
-        Entity_t *src = ecs_dense_at(cl, src_idx);
-        if (*src) {
-            if (src_idx != dst_idx) {
-                Entity_t *dst = ecs_dense_at(cl, dst_idx);
-                memcpy(dst, src, cl->component_size);
-                *src = 0;
-                cl->sparse[*dst >> ENTITY_ID_SHIFT] = dst_idx;
+    uint32_t g = 0;
+    while (index >= self->groups[g].start + self->groups[g].count) {
+        g++;
+    }
+
+    // Swap-remove inside the group
+    Event_Callback_Group *group = &self->groups[g];
+    uint32_t hole = group->start + group->count - 1;
+    self->data[index] = self->data[hole];
+    group->count--;
+
+    // The hole is now right before the next group, which fills it
+    // with its last callback, and so on
+    for (uint32_t h = g + 1; h < self->n_groups; ++h) {
+        Event_Callback_Group *next = &self->groups[h];
+        if (next->count) {
+            self->data[hole] = self->data[next->start + next->count - 1];
+        }
+        next->start--;
+        hole = next->start + next->count;
+    }
+    self->count--;
+
+    if (group->count == 0) {
+        memmove(group, group + 1, sizeof(*group) * (self->n_groups - g - 1));
+        self->n_groups--;
+    }
+}
+
+static void events_apply_pending(Event_Callbacks *self)
+{
+    if (self->n_removed) {
+        for (uint32_t i = self->count; i-- > 0;) {
+            if (!self->data[i].input) {
+                events_remove_at(self, i);
             }
-            dst_idx++;
         }
+        self->n_removed = 0;
     }
 
-    cl->count = dst_idx;
-    int start = (cl->count / DENSE_PAGE_SIZE);
-    if (cl->count % DENSE_PAGE_SIZE) {
-        start++;
+    for (uint32_t i = 0; i < self->n_pending; ++i) {
+        events_insert(self, &self->pending[i]);
+    }
+    self->n_pending = 0;
+}
+
+void events_subscribe(Event_Callbacks *self, Event_Callback callback)
+{
+    if (self->dispatch_depth) {
+        if (self->n_pending >= self->pending_capacity) {
+            self->pending = (Event_Callback *) events_grow(self, self->pending,
+                &self->pending_capacity, self->n_pending, sizeof(Event_Callback));
+        }
+        self->pending[self->n_pending++] = callback;
+        return;
     }
+    events_insert(self, &callback);
+}
 
-    for (int i = start; i < cl->n_dense_pages; ++i) {
-        if (cl->dense[i]) {
-            free(cl->dense[i]);
-            cl->dense[i] = NULL;
+bool events_unsubscribe(Event_Callbacks *self, Event_Callback callback)
+{
+    // It might not have been added yet
+    for (uint32_t i = 0; i < self->n_pending; ++i) {
+        if (self->pending[i].input == callback.input && self->pending[i].arg == callback.arg) {
+            self->pending[i] = self->pending[--self->n_pending];
+            return true;
         }
     }
 
-    cl->n_dense_pages = start;
+    for (uint32_t i = 0; i < self->count; ++i) {
+        Event_Callback *it = &self->data[i];
+        if (!it->input || it->input != callback.input || it->arg != callback.arg) {
+            continue;
+        }
+
+        if (self->dispatch_depth) {
+            // Don't move things around under the dispatch loop
+            it->input = NULL;
+            self->n_removed++;
+        } else {
+            events_remove_at(self, i);
+        }
+        return true;
+    }
+    return false;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Event queue
 
+void events_queue_init(Event_Queue *self, uint32_t capacity)
+{
+    memset(self, 0, sizeof(*self));
 
-Idx_t ecs_cl_count(int id)
+    // Round up to a power of 2, so wrapping is a mask
+    uint32_t pow2 = 1;
+    while (pow2 < capacity) {
+        pow2 <<= 1;
+    }
+
+    self->capacity = pow2;
+    self->events = (Event_t *) malloc(sizeof(Event_t) * self->capacity);
+    if (!self->events) {
+        FAIL_MESSAGE("Couldn't allocate the event queue");
+    }
+
+    // One arena for all the subscriber lists
+    self->arena = arena_alloc();
+    for (int i = 0; i < EVENT_TYPE_COUNT; ++i) {
+        events_callbacks_init(&self->by_type[i], self->arena);
+    }
+}
+
+void events_queue_deinit(Event_Queue *self)
 {
-    Component_List *cl = &component_lists[id];
-    return cl->count;
+    for (int i = 0; i < EVENT_TYPE_COUNT; ++i) {
+        events_callbacks_deinit(&self->by_type[i]);
+    }
+    if (self->arena) {
+        arena_release(self->arena);
+    }
+    free(self->table);
+    free(self->events);
+    memset(self, 0, sizeof(*self));
 }
 
-void* ecs_cl_at(int id, Idx_t index)
+void events_queue_subscribe(Event_Queue *self, Event_Callback callback)
 {
-    Component_List *cl = &component_lists[id];
-    return ecs_dense_at(cl, index);
+    for (int bit = 0; bit < EVENT_TYPE_COUNT; ++bit) {
+        if ((unsigned int) callback.type_mask & (1U << bit)) {
+            events_subscribe(&self->by_type[bit], callback);
+        }
+    }
 }
 
-void* ecs_cl_begin(int id)
+void events_queue_unsubscribe(Event_Queue *self, Event_Callback callback)
 {
-    Component_List *cl = &component_lists[id];
-    cl->deleted_component = false;
-    return cl->dense[0];
+    for (int bit = 0; bit < EVENT_TYPE_COUNT; ++bit) {
+        if ((unsigned int) callback.type_mask & (1U << bit)) {
+            events_unsubscribe(&self->by_type[bit], callback);
+        }
+    }
 }
 
-void* ecs_cl_next(int id, void *iter)
+static inline unsigned int events_lowest_bit(unsigned int bits)
 {
-    Component_List *cl = &component_lists[id];
+    unsigned int bit = 0;
+    while (!(bits & (1U << bit))) {
+        bit++;
+    }
+    return bit;
+}
 
-    Entity_t *next = 0;
-    if (cl->deleted_component) {
-        cl->deleted_component = false;
-        if (!cl->count) {
-            return NULL;
-        }
-        next = (Entity_t *) iter;
-    } else {
-        next = (Entity_t *)((char *) iter + cl->component_size);
+void events_queue_set_coalesce(Event_Queue *self, unsigned int type, uint32_t policy)
+{
+    if (!type) {
+        return;
     }
+    self->coalesce[events_lowest_bit(type)] = (uint8_t) policy;
 
-    if (!(*next & ENTITY_VERSION_MASK)) {
-        if (*next & ENTITY_ID_MASK) {
-            Idx_t dense_idx = *next >> ENTITY_ID_SHIFT;
-            next = (Entity_t *) cl->dense[dense_idx];
-        } else {
-            return NULL;
+    if (policy && !self->table) {
+        self->table_capacity = 256;
+        self->table = (Event_Coalesce_Entry *) calloc(self->table_capacity, sizeof(Event_Coalesce_Entry));
+        if (!self->table) {
+            FAIL_MESSAGE("Couldn't allocate the event coalescing table");
         }
     }
+}
 
-    return next;
+void events_queue_set_filter(Event_Queue *self, unsigned int type, Event_Filter filter, void *arg)
+{
+    if (!type) {
+        return;
+    }
+    unsigned int bit = events_lowest_bit(type);
+    self->filters[bit] = filter;
+    self->filter_args[bit] = arg;
 }
 
-// Flag sets
-void ecs_cl_allow_purge(int id, bool allow)
+static inline uint32_t events_coalesce_hash(unsigned int type, int param1)
 {
-    Component_List *cl = &component_lists[id];
-    cl->no_purge = !allow;
+    uint32_t h = (uint32_t) type * 0x9E3779B1u;
+    h ^= (uint32_t) param1 + 0x7F4A7C15u + (h << 6) + (h >> 2);
+    return h;
 }
-void ecs_cl_keep_ordering(int id, bool keep)
+
+// Entries from before the last flush are dead. They only matter to
+// EVENT_COALESCE_DROP_REPEATS, which looks one frame back.
+static inline bool events_entry_alive(Event_Queue *self, Event_Coalesce_Entry *entry)
 {
-    Component_List *cl = &component_lists[id];
-    cl->keep_ordering = keep;
+    return entry->used && self->generation - entry->generation <= 1;
 }
 
-void ecs_purge_cls(void)
+// Only an unused slot ends the search. Dead entries stay where they are,
+// since live ones with other keys may have probed past them, and only get
+// reset when it's their own key coming back.
+static Event_Coalesce_Entry* events_coalesce_find(Event_Queue *self, unsigned int type, int param1)
 {
-    for (int id = 0; id < 128; ++id) {
-        Component_List *cl = &component_lists[id];
-        if (!cl->initialized || cl->no_purge) {
-            continue;
+    uint32_t mask = self->table_capacity - 1;
+    uint32_t i = events_coalesce_hash(type, param1) & mask;
+
+    while (true) {
+        Event_Coalesce_Entry *entry = &self->table[i];
+        if (!entry->used) {
+            self->table_inserts++;
+            break;
+        }
+        if (entry->type == type && entry->param1 == param1) {
+            if (events_entry_alive(self, entry)) {
+                return entry;
+            }
+            break;
         }
+        i = (i + 1) & mask;
+    }
 
-        // We're purging everything
+    Event_Coalesce_Entry *entry = &self->table[i];
+    memset(entry, 0, sizeof(*entry));
+    entry->type = type;
+    entry->param1 = param1;
+    return entry;
+}
+
+// Rebuilds the table with only the live entries. It only doubles if they
+// would fill more than a quarter of it, so keys that come and go don't
+// make it grow forever.
+static void events_coalesce_rebuild(Event_Queue *self)
+{
+    Event_Coalesce_Entry *old = self->table;
+    uint32_t old_capacity = self->table_capacity;
+
+    uint32_t live = 0;
+    for (uint32_t i = 0; i < old_capacity; ++i) {
+        live += events_entry_alive(self, &old[i]);
+    }
+    if (live >= old_capacity / 4) {
+        self->table_capacity *= 2;
+    }
+    self->table = (Event_Coalesce_Entry *) calloc(self->table_capacity, sizeof(Event_Coalesce_Entry));
+    if (!self->table) {
+        FAIL_MESSAGE("Couldn't rebuild the event coalescing table");
+    }
 
-        // Dense pages
-        for (unsigned int i = 0; i < cl->n_dense_pages; ++i) {
-            free(cl->dense[i]);
-            cl->dense[i] = NULL;
+    self->table_inserts = 0;
+    for (uint32_t i = 0; i < old_capacity; ++i) {
+        if (events_entry_alive(self, &old[i])) {
+            Event_Coalesce_Entry *entry = events_coalesce_find(self, old[i].type, old[i].param1);
+            *entry = old[i];
         }
+    }
+    free(old);
+}
+
+// Returns true if the event got merged or dropped
+static bool events_coalesce(Event_Queue *self, const Event_t *ev, uint32_t policy)
+{
+    if (self->table_inserts >= self->table_capacity / 2) {
+        events_coalesce_rebuild(self);
+    }
+
+    int param1 = (policy & EVENT_COALESCE_BY_PARAM1) ? ev->param1 : 0;
+    Event_Coalesce_Entry *entry = events_coalesce_find(self, ev->type, param1);
+    bool fresh = !entry->used;
+    bool this_frame = !fresh && entry->generation == self->generation;
+
+    // Is the event it refers to still waiting in the ring?
+    uint32_t first = self->posted - self->count;
+    Event_t *queued = NULL;
+    if (this_frame && entry->index - first < self->count) {
+        queued = &self->events[(self->head + (entry->index - first)) & (self->capacity - 1)];
+    }
+
+    bool merged = false;
+    switch (policy & ~EVENT_COALESCE_BY_PARAM1) {
+        case EVENT_COALESCE_LATEST:
+            if (queued) {
+                *queued = *ev;
+                merged = true;
+            }
+            break;
+        case EVENT_COALESCE_ACCUMULATE:
+            if (queued) {
+                queued->param1 += ev->param1;
+                queued->param2 += ev->param2;
+                merged = true;
+            }
+            break;
+        case EVENT_COALESCE_DROP_REPEATS:
+            merged = !fresh &&
+                entry->last.param1 == ev->param1 && entry->last.param2 == ev->param2;
+            break;
+        default:
+            break;
+    }
+
+    entry->used = true;
+    entry->last = *ev;
+    entry->generation = self->generation;
+    if (!merged) {
+        // It's the next one to be queued
+        entry->index = self->posted;
+    }
+    return merged;
+}
 
-        // Sparse entities
-        for (unsigned int i = 0; i < MAX_ENTITIES; ++i) {
-            cl->sparse[i] = SPARSE_NONE;
+void events_post(Event_Queue *self, const Event_t *ev)
+{
+    if (ev->type) {
+        unsigned int bit = events_lowest_bit(ev->type);
+        if (self->filters[bit] && !self->filters[bit](self->filter_args[bit], ev)) {
+            return;
+        }
+        if (self->coalesce[bit] && events_coalesce(self, ev, self->coalesce[bit])) {
+            return;
         }
+    }
 
-        cl->n_dense_pages = 0;
-        cl->count = 0;
+    if (self->count == self->capacity) {
+        // Unwrap into a ring that's twice as big
+        uint32_t capacity = self->capacity * 2;
+        Event_t *events = (Event_t *) malloc(sizeof(Event_t) * capacity);
+        if (!events) {
+            FAIL_MESSAGE("Couldn't grow the event queue");
+        }
+        for (uint32_t i = 0; i < self->count; ++i) {
+            events[i] = self->events[(self->head + i) & (self->capacity - 1)];
+        }
+        free(self->events);
+        self->events = events;
+        self->capacity = capacity;
+        self->head = 0;
+    }
+
+    self->events[(self->head + self->count) & (self->capacity - 1)] = *ev;
+    self->count++;
+    self->posted++;
+}
+
+static void events_dispatch(Event_Queue *self, Event_t *ev)
+{
+    unsigned int done = 0;
+    for (unsigned int bits = ev->type; bits; bits &= bits - 1) {
+        unsigned int bit = events_lowest_bit(bits);
+
+        Event_Callbacks *subscribers = &self->by_type[bit];
+        subscribers->dispatch_depth++;
+        for (uint32_t g = 0; g < subscribers->n_groups; ++g) {
+            Event_Callback_Group *group = &subscribers->groups[g];
+            // Already got this event through an earlier bit
+            if ((unsigned int) group->type_mask & done) {
+                continue;
+            }
+
+            Event_Callback *callback = &subscribers->data[group->start];
+            for (uint32_t i = 0; i < group->count; ++i, ++callback) {
+                if (callback->input) {
+                    callback->input(callback->arg, ev);
+                }
+            }
+        }
+        if (--subscribers->dispatch_depth == 0) {
+            events_apply_pending(subscribers);
+        }
+        done |= 1U << bit;
     }
+}
+
+void events_flush(Event_Queue *self)
+{
+    // Events posted from here on can't merge into the ones being dispatched
+    self->generation++;
+
+    uint32_t n = self->count;
+    for (uint32_t i = 0; i < n; ++i) {
+        // Copy it out, a callback might post and grow the ring
+        Event_t ev = self->events[self->head];
+        self->head = (self->head + 1) & (self->capacity - 1);
+        self->count--;
 
-    for (unsigned int i = 0; i < MAX_ENTITIES; ++i) {
-        entity_list[i] = (i + 1) << ENTITY_ID_SHIFT | 1;
-        entity_component_lists[i*2]  = 0;
-        entity_component_lists[i*2+1]= 0;
+        events_dispatch(self, &ev);
     }
-    first_free_entity = 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Multi-producer, single-consumer event queue
+//
+// Each slot has a sequence number. For the position p that maps to it,
+// the slot is free when sequence == p, and holds an event when
+// sequence == p + 1. The consumer frees it for the next lap by setting
+// it to p + capacity.
 
-// Entity manipulation
-Entity_t ecs_new_entity(void)
+void events_mpsc_init(Event_Mpsc_Queue *self, uint32_t capacity)
 {
-    if (first_free_entity == MAX_ENTITIES) {
-        FAIL_MESSAGE("Entity limit reached.");
+    memset(self, 0, sizeof(*self));
+
+    uint32_t pow2 = 2;
+    while (pow2 < capacity) {
+        pow2 <<= 1;
+    }
+
+    self->capacity = pow2;
+    self->mask = pow2 - 1;
+    self->slots = (Event_Mpsc_Slot *) malloc(sizeof(Event_Mpsc_Slot) * pow2);
+    if (!self->slots) {
+        FAIL_MESSAGE("Couldn't allocate the event queue");
     }
 
-    Entity_t *entity = &entity_list[first_free_entity];
-    Entity_t result = (first_free_entity << ENTITY_ID_SHIFT);
+    for (uint32_t i = 0; i < pow2; ++i) {
+        self->slots[i].sequence = i;
+    }
+}
 
-    if (first_free_entity == (*entity >> ENTITY_ID_SHIFT)) {
-        printf("ECS error\n");
+void events_mpsc_deinit(Event_Mpsc_Queue *self)
+{
+    free(self->slots);
+    self->slots = NULL;
+}
+
+bool events_mpsc_post_many(Event_Mpsc_Queue *self, const Event_t *evs, uint32_t count)
+{
+    if (count == 0) {
+        return true;
+    }
+    if (count > self->capacity) {
+        return false;
     }
 
-    first_free_entity = *entity >> ENTITY_ID_SHIFT;
-    *entity = ((MAX_ENTITIES - 1) << ENTITY_ID_SHIFT) | (*entity & ENTITY_VERSION_MASK);
+    uint32_t pos = ATOMIC_LOAD_32(&self->tail);
+    while (true) {
+        // The consumer frees slots in order, so if the last slot of the range
+        // is free, the ones before it are free too
+        uint32_t last = pos + count - 1;
+        uint32_t seq = ATOMIC_LOAD_32(&self->slots[last & self->mask].sequence);
+        int32_t diff = (int32_t) (seq - last);
 
-    return result;
+        if (diff == 0) {
+            if (ATOMIC_CAS_32(&self->tail, pos, pos + count)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Full
+            return false;
+        }
+        pos = ATOMIC_LOAD_32(&self->tail);
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        Event_Mpsc_Slot *slot = &self->slots[(pos + i) & self->mask];
+        slot->ev = evs[i];
+        ATOMIC_STORE_32(&slot->sequence, pos + i + 1);
+    }
+    return true;
 }
 
-static void ecs_unreg_entity(Entity_t entity)
+bool events_mpsc_post(Event_Mpsc_Queue *self, const Event_t *ev)
 {
-    // No error checking here
-    Idx_t idx = entity >> ENTITY_ID_SHIFT;
-    Entity_t *en = &entity_list[idx];
+    return events_mpsc_post_many(self, ev, 1);
+}
+
+uint32_t events_mpsc_drain(Event_Mpsc_Queue *self, Event_Callbacks *subscribers, uint32_t max)
+{
+    uint32_t drained = 0;
+    while (!max || drained < max) {
+        Event_Mpsc_Slot *slot = &self->slots[self->head & self->mask];
+        if (ATOMIC_LOAD_32(&slot->sequence) != self->head + 1) {
+            // Empty, or the next event isn't published yet
+            break;
+        }
 
-    printf("Deleting entity %d\n", idx);
+        Event_t ev = slot->ev;
+        ATOMIC_STORE_32(&slot->sequence, self->head + self->capacity);
+        self->head++;
 
-    // Delete entity from list
-    unsigned int version = entity & ENTITY_VERSION_MASK;
-    version = (version == ENTITY_VERSION_MASK) ? 1 : version + 1;
-    *en = (first_free_entity << ENTITY_ID_SHIFT) | version;
-    first_free_entity = idx;
+        events_notify_input(subscribers, &ev);
+        drained++;
+    }
+    return drained;
 }
 
+void events_batch_init(Event_Batch *self, Event_Mpsc_Queue *queue)
+{
+    self->queue = queue;
+    self->count = 0;
+}
 
-void ecs_delete_entity(Entity_t entity)
+bool events_batch_flush(Event_Batch *self)
 {
-    Idx_t idx = entity >> ENTITY_ID_SHIFT;
-    Entity_t *e = &entity_list[idx];
+    if (!events_mpsc_post_many(self->queue, self->events, self->count)) {
+        return false;
+    }
+    self->count = 0;
+    return true;
+}
 
-    if (*e >> ENTITY_ID_SHIFT != MAX_ENTITIES - 1) {
-        // Entity doesn't exist
-        return;
+bool events_batch_add(Event_Batch *self, const Event_t *ev)
+{
+    if (self->count == EVENT_MPSC_BATCH_SIZE && !events_batch_flush(self)) {
+        return false;
     }
 
-    if ((*e & ENTITY_VERSION_MASK) != (entity & ENTITY_VERSION_MASK)) {
-        // Entity already has a new version
-        return;
+    self->events[self->count++] = *ev;
+    if (self->count == EVENT_MPSC_BATCH_SIZE) {
+        events_batch_flush(self);
     }
+    return true;
+}
 
-    // Delete its components
-    uint64_t *components = &entity_component_lists[idx * 2];
-    for (int i = 0; i < 2; ++i) {
-        for (int j = 0; components[i] && j < 64; ++j) {
-            if (components[i] & (1ULL << j)) {
-                ecs_remove_component(i*64 + j, entity);
+///////////////////////////////////////////////////////////////////////////////
+// Scene system
+///////////////////////////////////////////////////////////////////////////////
+
+// Double buffered: one scene is running while the other one loads
+static Scene _scenes[2];
+static int _current_scene;
+
+static Event_Callbacks _scene_handlers;
+
+static Arena *_persistent_arena;
+static Arena *_frame_arena;
+
+static Scene_Entry *_scene_registry;
+static uint32_t _scene_registry_capacity;
+static uint32_t _scene_registry_count;
+
+typedef enum Scene_Load_State {
+    SCENE_IDLE = 0,
+    // A switch is waiting for scene_update()
+    SCENE_PENDING,
+    // The loader thread owns the next scene
+    SCENE_LOADING,
+    // The loader is done, the next scene can be swapped in
+    SCENE_READY,
+} Scene_Load_State;
+
+static uint32_t _scene_state;
+static OS_Thread _scene_loader;
+static Scene_Load_Fn _scene_load;
+static void *_scene_load_arg;
+
+Event_Callbacks* scene_handlers(void)
+{
+    return &_scene_handlers;
+}
+
+static Scene* scene_next(void)
+{
+    return &_scenes[1 - _current_scene];
+}
+
+Arena* scene_arena(Scene_Arena_Kind kind)
+{
+    switch (kind) {
+        case SCENE_ARENA_PERSISTENT:
+            if (!_persistent_arena) {
+                _persistent_arena = arena_alloc();
+            }
+            return _persistent_arena;
+        case SCENE_ARENA_SCENE:
+            return _scenes[_current_scene].arena;
+        case SCENE_ARENA_FRAME:
+            if (!_frame_arena) {
+                _frame_arena = arena_alloc();
             }
+            return _frame_arena;
+        default:
+            return NULL;
+    }
+}
+
+Scene_Id scene_id(const char *name)
+{
+    Scene_Id h = SCENE_ID_OFFSET;
+    for (const char *c = name; *c; ++c) {
+        h = (h ^ (uint8_t) *c) * SCENE_ID_PRIME;
+    }
+    return h ? h : 1;
+}
+
+// Open addressing, keyed by id
+static Scene_Entry* scene_registry_slot(Scene_Id id)
+{
+    uint32_t mask = _scene_registry_capacity - 1;
+    for (uint32_t i = id & mask; ; i = (i + 1) & mask) {
+        Scene_Entry *entry = &_scene_registry[i];
+        if (entry->id == id || entry->id == SCENE_ID_NONE) {
+            return entry;
         }
     }
 }
 
-void ecs_init(void)
+Scene_Entry* scene_lookup(Scene_Id id)
+{
+    if (!_scene_registry || id == SCENE_ID_NONE) {
+        return NULL;
+    }
+    Scene_Entry *entry = scene_registry_slot(id);
+    return entry->id == id ? entry : NULL;
+}
+
+static void scene_registry_grow(void)
+{
+    Scene_Entry *old = _scene_registry;
+    uint32_t old_capacity = _scene_registry_capacity;
+
+    _scene_registry_capacity = old ? old_capacity * 2 : SCENE_REGISTRY_DEFAULT_CAPACITY;
+    _scene_registry = (Scene_Entry *) calloc(_scene_registry_capacity, sizeof(Scene_Entry));
+    if (!_scene_registry) {
+        FAIL_MESSAGE("Couldn't allocate the scene registry");
+    }
+
+    for (uint32_t i = 0; i < old_capacity; ++i) {
+        if (old[i].id != SCENE_ID_NONE) {
+            *scene_registry_slot(old[i].id) = old[i];
+        }
+    }
+    free(old);
+}
+
+Scene_Id scene_register(const char *name, const Scene_Desc *desc)
+{
+    // Stay at most half full
+    if ((_scene_registry_count + 1) * 2 > _scene_registry_capacity) {
+        scene_registry_grow();
+    }
+
+    Scene_Id id = scene_id(name);
+    Scene_Entry *entry = scene_registry_slot(id);
+    if (entry->id == SCENE_ID_NONE) {
+        entry->id = id;
+        entry->name = arena_push_cstr(scene_arena(SCENE_ARENA_PERSISTENT), name);
+        _scene_registry_count++;
+    } else if (strcmp(entry->name, name) != 0) {
+        FAIL_MESSAGE("Scene names \"%s\" and \"%s\" have the same hash", entry->name, name);
+    }
+
+    if (desc) {
+        entry->desc = *desc;
+    } else {
+        memset(&entry->desc, 0, sizeof(entry->desc));
+    }
+    if (!entry->desc.retain_warm) {
+        scene_evict(id);
+    }
+    return id;
+}
+
+void scene_evict(Scene_Id id)
 {
-    for (unsigned int i = 0; i < MAX_ENTITIES; ++i) {
-        entity_list[i] = (i + 1) << ENTITY_ID_SHIFT | 1;
+    Scene_Entry *entry = scene_lookup(id);
+    if (entry && entry->warm_arena) {
+        arena_release(entry->warm_arena);
+        entry->warm_arena = NULL;
+        entry->warm_data = NULL;
     }
 }
+
+// Clearing the arena frees all of the scene's memory in one go.
+// The arena's blocks are kept for the next scene that uses this buffer.
+// A warm scene hands its arena back to the registry instead, minus
+// what got allocated after loading.
+static void scene_release(Scene *scene)
+{
+    Scene_Entry *entry = scene_lookup(scene->id);
+    if (entry && entry->desc.retain_warm && scene->arena) {
+        arena_pop_to(scene->arena, scene->loaded_position);
+        // The same scene may have been loaded twice
+        scene_evict(scene->id);
+        entry->warm_arena = scene->arena;
+        entry->warm_data = scene->data;
+        entry->warm_position = scene->loaded_position;
+        scene->arena = NULL;
+    } else if (scene->arena) {
+        arena_clear(scene->arena);
+    }
+    scene->id = SCENE_ID_NONE;
+    scene->name = NULL;
+    scene->data = NULL;
+    scene->loaded_position = 0;
+}
+
+static Scene* scene_prepare_next(Scene_Id id, const char *to)
+{
+    Scene *next = scene_next();
+    Scene_Entry *entry = scene_lookup(id);
+
+    if (entry && entry->warm_arena) {
+        // Pick up where the scene was left
+        if (next->arena) {
+            arena_release(next->arena);
+        }
+        next->arena = entry->warm_arena;
+        next->data = entry->warm_data;
+        next->loaded_position = entry->warm_position;
+        entry->warm_arena = NULL;
+        entry->warm_data = NULL;
+    } else if (!next->arena) {
+        next->arena = arena_alloc();
+    }
+
+    next->id = id;
+    // Unregistered names get copied, since the caller's string may not last
+    next->name = entry ? entry->name : arena_push_cstr(next->arena, to);
+    return next;
+}
+
+static void scene_loader_main(void *arg)
+{
+    Scene *next = (Scene *) arg;
+
+    arena_system_init();
+    next->data = _scene_load(_scene_load_arg, next->arena, next->name);
+    next->loaded_position = arena_position(next->arena);
+    arena_system_deinit();
+
+    ATOMIC_STORE_32(&_scene_state, SCENE_READY);
+}
+
+// Waits for a load that's in flight, and throws it away
+static void scene_cancel_load(void)
+{
+    uint32_t state = ATOMIC_LOAD_32(&_scene_state);
+    if (state == SCENE_LOADING || state == SCENE_READY) {
+        os_thread_join(_scene_loader);
+    }
+    if (state != SCENE_IDLE) {
+        scene_release(scene_next());
+        ATOMIC_STORE_32(&_scene_state, SCENE_IDLE);
+    }
+}
+
+static void scene_start_load(Scene *next, Scene_Load_Fn load, void *arg)
+{
+    _scene_load = load;
+    _scene_load_arg = arg;
+
+    ATOMIC_STORE_32(&_scene_state, SCENE_LOADING);
+    os_thread_create(&_scene_loader, scene_loader_main, next);
+}
+
+bool scene_switch_id(Scene_Id id)
+{
+    Scene_Entry *entry = scene_lookup(id);
+    if (!entry) {
+        return false;
+    }
+
+    scene_cancel_load();
+    bool warm = entry->warm_arena != NULL;
+    Scene *next = scene_prepare_next(id, NULL);
+
+    if (!warm && entry->desc.load) {
+        scene_start_load(next, entry->desc.load, entry->desc.arg);
+    } else {
+        if (!warm) {
+            next->loaded_position = arena_position(next->arena);
+        }
+        ATOMIC_STORE_32(&_scene_state, SCENE_PENDING);
+    }
+    return true;
+}
+
+// The id to switch to, and the entry if the name is registered. The hash
+// isn't enough: a name that only has the same hash as a registered scene
+// gets no id, so it doesn't pick up the other scene's entry.
+static Scene_Id scene_switch_target(const char *name, Scene_Entry **entry)
+{
+    Scene_Id id = scene_id(name);
+    *entry = scene_lookup(id);
+    if (*entry && strcmp((*entry)->name, name) != 0) {
+        *entry = NULL;
+        return SCENE_ID_NONE;
+    }
+    return id;
+}
+
+void scene_switch(const char *to)
+{
+    Scene_Entry *entry;
+    Scene_Id id = scene_switch_target(to, &entry);
+    if (entry) {
+        scene_switch_id(id);
+        return;
+    }
+
+    scene_cancel_load();
+    Scene *next = scene_prepare_next(id, to);
+    next->loaded_position = arena_position(next->arena);
+
+    ATOMIC_STORE_32(&_scene_state, SCENE_PENDING);
+}
+
+void scene_switch_async(const char *to, Scene_Load_Fn load, void *arg)
+{
+    Scene_Entry *entry;
+    Scene_Id id = scene_switch_target(to, &entry);
+    if (entry && entry->warm_arena) {
+        // Already loaded, load() would only build it again on top
+        scene_switch_id(id);
+        return;
+    }
+    if (!load) {
+        scene_switch(to);
+        return;
+    }
+
+    scene_cancel_load();
+    Scene *next = scene_prepare_next(id, to);
+    scene_start_load(next, load, arg);
+}
+
+bool scene_is_loading(void)
+{
+    return ATOMIC_LOAD_32(&_scene_state) == SCENE_LOADING;
+}
+
+// Deferred action
+static void scene_do_switch(void)
+{
+    uint32_t state = ATOMIC_LOAD_32(&_scene_state);
+    if (state == SCENE_IDLE || state == SCENE_LOADING) {
+        return;
+    }
+    if (state == SCENE_READY) {
+        os_thread_join(_scene_loader);
+    }
+
+    if (g_scene_name) {
+        // End the previous scene
+        Scene_Entry *entry = scene_lookup(g_scene_id);
+        if (entry && entry->desc.on_end) {
+            entry->desc.on_end(entry->desc.arg, g_scene_data);
+        }
+        events_end_scene();
+    }
+
+    // Drop the ECS pages that point into the old scene's arena,
+    // then free the whole scene at once
+    ecs_purge_cls();
+    scene_release(&_scenes[_current_scene]);
+
+    // Swap the buffers and start the new scene
+    _current_scene = 1 - _current_scene;
+    Scene *scene = &_scenes[_current_scene];
+    g_scene_name = scene->name;
+    g_scene_id = scene->id;
+    g_scene_data = scene->data;
+
+    Scene_Entry *entry = scene_lookup(g_scene_id);
+    if (entry && entry->desc.on_start) {
+        entry->desc.on_start(entry->desc.arg, g_scene_data);
+    }
+    events_start_scene();
+
+    ATOMIC_STORE_32(&_scene_state, SCENE_IDLE);
+}
+
+void scene_update(void)
+{
+    if (_frame_arena) {
+        arena_clear(_frame_arena);
+    }
+    scene_do_switch();
+}
+
+void scene_system_deinit(void)
+{
+    scene_cancel_load();
+
+    for (int i = 0; i < 2; ++i) {
+        if (_scenes[i].arena) {
+            arena_release(_scenes[i].arena);
+        }
+        memset(&_scenes[i], 0, sizeof(_scenes[i]));
+    }
+    for (uint32_t i = 0; i < _scene_registry_capacity; ++i) {
+        if (_scene_registry[i].warm_arena) {
+            arena_release(_scene_registry[i].warm_arena);
+        }
+    }
+    free(_scene_registry);
+    _scene_registry = NULL;
+    _scene_registry_capacity = 0;
+    _scene_registry_count = 0;
+
+    if (_frame_arena) {
+        arena_release(_frame_arena);
+        _frame_arena = NULL;
+    }
+    if (_persistent_arena) {
+        arena_release(_persistent_arena);
+        _persistent_arena = NULL;
+    }
+
+    events_callbacks_deinit(&_scene_handlers);
+    g_scene_name = NULL;
+    g_scene_id = SCENE_ID_NONE;
+    g_scene_data = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Entity component system (ECS)
+///////////////////////////////////////////////////////////////////////////////
+
+#define DENSE_PAGE_SIZE 1024
+#define DENSE_PAGE_LIST_SIZE (MAX_ENTITIES / DENSE_PAGE_SIZE)
+#define SPARSE_NONE ((Idx_t)-1)
+// Sparse arrays are split into pages that get allocated when an entity in
+// their range first gets the component
+#define SPARSE_PAGE_SIZE 4096
+#define SPARSE_PAGE_COUNT (MAX_ENTITIES / SPARSE_PAGE_SIZE)
+
+typedef struct Ecs_Change {
+    Entity_t entity;
+    uint32_t frame;
+} Ecs_Change;
+
+typedef struct Component_List {
+    bool initialized;
+
+    // Flags
+    bool no_purge;
+    bool deleted_component;
+    bool keep_ordering;
+    // Stored in archetypes instead of dense pages
+    bool archetype;
+
+    unsigned int component_size;
+    unsigned int count;
+    unsigned int n_dense_pages;
+    // Bytes per dense page, with the sentinel at the end of the entities
+    size_t page_size;
+
+    // Struct-of-arrays lists have a column per field after the entity
+    // column. component_size is just the entity's then, so the entity
+    // column gets walked like the dense array of any other list.
+    int n_fields;
+    unsigned int field_sizes[ECS_SOA_MAX_FIELDS];
+    size_t field_offsets[ECS_SOA_MAX_FIELDS];
+
+    // Create/delete notifier
+    //void *arg;
+
+    // Where the dense pages came from, NULL for malloc.
+    // Arena pages are never freed one by one.
+    Arena *page_arena;
+
+    Idx_t *sparse[SPARSE_PAGE_COUNT];
+    unsigned int n_sparse_pages;
+    void *dense[DENSE_PAGE_LIST_SIZE];
+
+    // Change tracking. The frame each entity's component last changed in,
+    // paged like the sparse array, and a log of the changes in frame order.
+    bool track_changes;
+    uint32_t *stamps[SPARSE_PAGE_COUNT];
+    Ecs_Change *changes;
+    uint32_t n_changes;
+    uint32_t changes_capacity;
+    // Writers on different threads share the log
+    OS_Mutex changes_mutex;
+} Component_List;
+
+// The entity tables sit in reserved address space. Memory gets committed
+// as new entity IDs get handed out, and IDs above the high-water mark have
+// never been used, so nothing has to touch them.
+#define ENTITY_COMMIT_STEP 4096
+// Free list links, in place of a next ID
+#define ENTITY_ALIVE (MAX_ENTITIES - 1)
+#define ENTITY_FREE_END (MAX_ENTITIES - 2)
+
+// Where an entity's row is, for components in archetype storage
+typedef struct Ecs_Location {
+    uint32_t archetype;
+    uint32_t row;
+} Ecs_Location;
+
+struct Ecs_Archetype;
+struct Ecs_Command_Ref;
+struct Ecs_Sort_Entry;
+
+// Spare dense pages of one size, linked through their first bytes
+typedef struct Ecs_Page_Pool {
+    size_t page_size;
+    void *free;
+    uint32_t n_free;
+} Ecs_Page_Pool;
+
+// Everything an ECS instance owns. Worlds don't share any state, so
+// different threads can each run their own.
+struct Ecs_World {
+    bool initialized;
+    Component_List component_lists[MAX_COMPONENT_LISTS];
+    uint32_t frame;
+
+    uint32_t first_free_entity;
+    Entity_t *entity_list;
+    uint64_t *entity_component_lists;
+    Ecs_Location *entity_locations;
+    uint32_t entity_high_water;
+    uint32_t entity_committed;
+
+    struct Ecs_Archetype *archetypes;
+    uint32_t n_archetypes;
+    uint32_t archetypes_capacity;
+    // Mask -> archetype index, open addressing
+    uint32_t *archetype_table;
+    uint32_t archetype_table_capacity;
+
+    struct Ecs_Command_Ref *command_refs;
+    uint32_t command_refs_capacity;
+
+    // Dense pages that don't come from a scene arena get carved out of
+    // page_arena, and go back to the pool for their size when a list is
+    // done with them. They only get freed along with the world.
+    Arena *page_arena;
+    Ecs_Page_Pool page_pools[MAX_COMPONENT_LISTS];
+    uint32_t n_page_pools;
+
+    // Kept around between sorts, the keys and a place for one component
+    struct Ecs_Sort_Entry *sort_entries;
+    uint32_t sort_entries_capacity;
+    char *sort_slot;
+    size_t sort_slot_size;
+
+    // Every thread's buffer, for ecs_commands_sync()
+    Ecs_Command_Buffer **thread_commands;
+    uint32_t n_thread_commands;
+    uint32_t thread_commands_capacity;
+    OS_Mutex thread_commands_mutex;
+    // The world's entry in each thread's table of buffers, and a number no
+    // other world ever had, so threads can tell a new world from an old one
+    uint32_t slot;
+    uint32_t serial;
+};
+
+static Ecs_World _ecs_default_world;
+
+static void ecs_entities_commit(Ecs_World *w, uint32_t count)
+{
+    if (count <= w->entity_committed) {
+        return;
+    }
+
+    uint32_t target = MIN((uint32_t) MAX_ENTITIES,
+        (count + ENTITY_COMMIT_STEP - 1) / ENTITY_COMMIT_STEP * ENTITY_COMMIT_STEP);
+    uint32_t added = target - w->entity_committed;
+
+    os_memory_commit(w->entity_list + w->entity_committed, sizeof(Entity_t) * added);
+    os_memory_commit(w->entity_component_lists + w->entity_committed * 2, sizeof(uint64_t) * 2 * added);
+    os_memory_commit(w->entity_locations + w->entity_committed, sizeof(Ecs_Location) * added);
+    w->entity_committed = target;
+}
+
+static inline Idx_t ecs_sparse_get(Component_List *cl, uint32_t i)
+{
+    Idx_t *page = cl->sparse[i / SPARSE_PAGE_SIZE];
+    return page ? page[i % SPARSE_PAGE_SIZE] : SPARSE_NONE;
+}
+
+// Only for entities that are already in the list, so the page exists
+static inline void ecs_sparse_set(Component_List *cl, uint32_t i, Idx_t idx)
+{
+    cl->sparse[i / SPARSE_PAGE_SIZE][i % SPARSE_PAGE_SIZE] = idx;
+}
+
+static Idx_t* ecs_sparse_slot(Component_List *cl, uint32_t i)
+{
+    Idx_t **page = &cl->sparse[i / SPARSE_PAGE_SIZE];
+    if (!*page) {
+        *page = (Idx_t *) malloc(sizeof(Idx_t) * SPARSE_PAGE_SIZE);
+        if (!*page) {
+            FAIL_MESSAGE("Couldn't allocate memory for sparse component list");
+        }
+        // SPARSE_NONE is all ones
+        memset(*page, 0xFF, sizeof(Idx_t) * SPARSE_PAGE_SIZE);
+        cl->n_sparse_pages++;
+    }
+    return &(*page)[i % SPARSE_PAGE_SIZE];
+}
+
+static void ecs_sparse_clear(Component_List *cl)
+{
+    for (unsigned int i = 0; cl->n_sparse_pages && i < SPARSE_PAGE_COUNT; ++i) {
+        if (cl->sparse[i]) {
+            free(cl->sparse[i]);
+            cl->sparse[i] = NULL;
+            cl->n_sparse_pages--;
+        }
+    }
+}
+
+static Ecs_Page_Pool* ecs_page_pool(Ecs_World *w, size_t page_size)
+{
+    Ecs_Page_Pool *pool = NULL;
+    for (uint32_t i = 0; i < w->n_page_pools; ++i) {
+        if (w->page_pools[i].page_size == page_size) {
+            return &w->page_pools[i];
+        }
+        if (!pool && !w->page_pools[i].free) {
+            pool = &w->page_pools[i];
+        }
+    }
+    // An empty pool can take any size, so only add one if there's none
+    if (!pool) {
+        if (w->n_page_pools == MAX_COMPONENT_LISTS) {
+            // Only after lists got set up again with lots of different sizes
+            FAIL_MESSAGE("Couldn't make a pool for dense pages of %zu bytes, there are already %d", page_size, MAX_COMPONENT_LISTS);
+        }
+        pool = &w->page_pools[w->n_page_pools++];
+    }
+    pool->page_size = page_size;
+    pool->free = NULL;
+    pool->n_free = 0;
+    return pool;
+}
+
+static void* ecs_page_alloc(Ecs_World *w, Component_List *cl)
+{
+    if (cl->n_dense_pages == 0) {
+        // Purgeable lists go away with the scene anyway. The scene only
+        // purges the default world, the others might be on other threads.
+        cl->page_arena = (cl->no_purge || w != &_ecs_default_world) ? NULL : scene_arena(SCENE_ARENA_SCENE);
+    }
+    if (cl->page_arena) {
+        return arena_push(cl->page_arena, cl->page_size, 16);
+    }
+
+    Ecs_Page_Pool *pool = ecs_page_pool(w, cl->page_size);
+    if (pool->free) {
+        void *page = pool->free;
+        pool->free = *(void **) page;
+        pool->n_free--;
+        return page;
+    }
+
+    if (!w->page_arena) {
+        w->page_arena = arena_alloc();
+    }
+    void *page = arena_push(w->page_arena, cl->page_size, 16);
+    if (!page) {
+        FAIL_MESSAGE("Couldn't allocate dense memory block!");
+    }
+    return page;
+}
+
+static void ecs_page_free(Ecs_World *w, Component_List *cl, uint32_t i)
+{
+    // Scene arena pages get freed with the scene
+    if (!cl->page_arena) {
+        Ecs_Page_Pool *pool = ecs_page_pool(w, cl->page_size);
+        *(void **) cl->dense[i] = pool->free;
+        pool->free = cl->dense[i];
+        pool->n_free++;
+    }
+    cl->dense[i] = NULL;
+    cl->n_dense_pages--;
+}
+
+// Lets go of the pages from index first on. Pages are always in a row from
+// page 0.
+static void ecs_dense_trim(Ecs_World *w, Component_List *cl, uint32_t first)
+{
+    for (uint32_t i = first; i < DENSE_PAGE_LIST_SIZE && cl->dense[i]; ++i) {
+        ecs_page_free(w, cl, i);
+    }
+}
+
+// Lists keep one empty page past their last component, so a count going
+// back and forth over a page boundary doesn't take and give back a page
+// every time. It goes once the count drops a whole page below it.
+static void ecs_dense_shrink(Ecs_World *w, Component_List *cl)
+{
+    if (cl->page_arena) {
+        // Arena pages stay, to be reused
+        return;
+    }
+    uint32_t used = (cl->count + DENSE_PAGE_SIZE - 1) / DENSE_PAGE_SIZE;
+    ecs_dense_trim(w, cl, used + 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Archetype storage
+//
+// Lists flagged with ecs_cl_use_archetypes() don't have their own dense
+// pages. Entities with the same set of such components share an archetype,
+// which keeps one column per component in fixed-size chunks. Adding or
+// removing a component moves the entity's row to another archetype.
+///////////////////////////////////////////////////////////////////////////////
+
+#define ECS_ARCHETYPE_CHUNK_SIZE (16 * 1024)
+#define ECS_ARCHETYPE_NONE ((uint32_t) -1)
+// Archetype 0 has no components, every entity starts there
+#define ECS_ARCHETYPE_EMPTY 0
+
+typedef struct Ecs_Archetype {
+    uint64_t mask[2];
+
+    // Component list IDs, in ascending order
+    int n_columns;
+    uint8_t *ids;
+    uint32_t *offsets;
+    uint32_t *sizes;
+    // Column of each component list, -1 if it isn't here
+    int8_t column_of[MAX_COMPONENT_LISTS];
+
+    uint32_t rows_per_chunk;
+    size_t chunk_size;
+    void **chunks;
+    uint32_t n_chunks;
+    uint32_t chunks_capacity;
+    uint32_t count;
+
+    // Archetypes we move to when adding/removing a component, found lazily
+    uint32_t add_edge[MAX_COMPONENT_LISTS];
+    uint32_t remove_edge[MAX_COMPONENT_LISTS];
+} Ecs_Archetype;
+
+static uint32_t ecs_arch_hash(const uint64_t mask[2])
+{
+    uint64_t h = mask[0] * 0x9E3779B97F4A7C15ULL ^ mask[1] * 0xC2B2AE3D27D4EB4FULL;
+    return (uint32_t) (h ^ (h >> 32));
+}
+
+static uint32_t* ecs_arch_table_slot(Ecs_World *w, const uint64_t mask[2])
+{
+    uint32_t m = w->archetype_table_capacity - 1;
+    for (uint32_t i = ecs_arch_hash(mask) & m; ; i = (i + 1) & m) {
+        uint32_t idx = w->archetype_table[i];
+        if (idx == ECS_ARCHETYPE_NONE ||
+            (w->archetypes[idx].mask[0] == mask[0] && w->archetypes[idx].mask[1] == mask[1])) {
+            return &w->archetype_table[i];
+        }
+    }
+}
+
+static void ecs_arch_table_grow(Ecs_World *w)
+{
+    free(w->archetype_table);
+    w->archetype_table_capacity = w->archetype_table_capacity ? w->archetype_table_capacity * 2 : 64;
+    w->archetype_table = (uint32_t *) malloc(sizeof(uint32_t) * w->archetype_table_capacity);
+    if (!w->archetype_table) {
+        FAIL_MESSAGE("Couldn't allocate the archetype table");
+    }
+    memset(w->archetype_table, 0xFF, sizeof(uint32_t) * w->archetype_table_capacity);
+
+    for (uint32_t i = 0; i < w->n_archetypes; ++i) {
+        *ecs_arch_table_slot(w, w->archetypes[i].mask) = i;
+    }
+}
+
+// Pointers to archetypes don't survive this, since the array may move
+static uint32_t ecs_arch_get(Ecs_World *w, const uint64_t mask[2])
+{
+    if (w->archetype_table) {
+        uint32_t idx = *ecs_arch_table_slot(w, mask);
+        if (idx != ECS_ARCHETYPE_NONE) {
+            return idx;
+        }
+    }
+
+    if (w->n_archetypes == w->archetypes_capacity) {
+        w->archetypes_capacity = w->archetypes_capacity ? w->archetypes_capacity * 2 : 16;
+        w->archetypes = (Ecs_Archetype *) realloc(w->archetypes, sizeof(Ecs_Archetype) * w->archetypes_capacity);
+        if (!w->archetypes) {
+            FAIL_MESSAGE("Couldn't allocate memory for archetypes");
+        }
+    }
+    // Stay at most half full
+    if ((w->n_archetypes + 1) * 2 > w->archetype_table_capacity) {
+        ecs_arch_table_grow(w);
+    }
+
+    uint32_t idx = w->n_archetypes++;
+    Ecs_Archetype *a = &w->archetypes[idx];
+    memset(a, 0, sizeof(*a));
+    a->mask[0] = mask[0];
+    a->mask[1] = mask[1];
+    memset(a->column_of, -1, sizeof(a->column_of));
+    memset(a->add_edge, 0xFF, sizeof(a->add_edge));
+    memset(a->remove_edge, 0xFF, sizeof(a->remove_edge));
+
+    unsigned int row_size = 0;
+    for (int id = 0; id < MAX_COMPONENT_LISTS; ++id) {
+        if (mask[id / 64] & (1ULL << (id % 64))) {
+            a->n_columns++;
+            row_size += w->component_lists[id].component_size;
+        }
+    }
+
+    if (a->n_columns) {
+        a->ids = (uint8_t *) malloc(a->n_columns);
+        a->offsets = (uint32_t *) malloc(sizeof(uint32_t) * a->n_columns);
+        a->sizes = (uint32_t *) malloc(sizeof(uint32_t) * a->n_columns);
+        if (!a->ids || !a->offsets || !a->sizes) {
+            FAIL_MESSAGE("Couldn't allocate memory for archetype columns");
+        }
+        a->rows_per_chunk = MAX(1u, ECS_ARCHETYPE_CHUNK_SIZE / row_size);
+
+        // Each column starts 16 byte aligned inside the chunk
+        size_t offset = 0;
+        int column = 0;
+        for (int id = 0; id < MAX_COMPONENT_LISTS; ++id) {
+            if (mask[id / 64] & (1ULL << (id % 64))) {
+                a->ids[column] = (uint8_t) id;
+                a->offsets[column] = (uint32_t) offset;
+                a->sizes[column] = w->component_lists[id].component_size;
+                a->column_of[id] = (int8_t) column;
+                offset += ((size_t) w->component_lists[id].component_size * a->rows_per_chunk + 15) & ~(size_t) 15;
+                column++;
+            }
+        }
+        a->chunk_size = offset;
+    }
+
+    *ecs_arch_table_slot(w, mask) = idx;
+    return idx;
+}
+
+static void ecs_arch_init(Ecs_World *w)
+{
+    if (!w->n_archetypes) {
+        uint64_t empty[2] = { 0, 0 };
+        ecs_arch_get(w, empty);
+    }
+}
+
+static inline void* ecs_arch_at(Ecs_Archetype *a, int column, uint32_t row)
+{
+    return (char *) a->chunks[row / a->rows_per_chunk] + a->offsets[column] +
+        (size_t) a->sizes[column] * (row % a->rows_per_chunk);
+}
+
+static uint32_t ecs_arch_push_row(Ecs_Archetype *a)
+{
+    uint32_t row = a->count++;
+    uint32_t chunk = row / a->rows_per_chunk;
+    if (chunk == a->n_chunks) {
+        if (a->n_chunks == a->chunks_capacity) {
+            a->chunks_capacity = a->chunks_capacity ? a->chunks_capacity * 2 : 4;
+            a->chunks = (void **) realloc(a->chunks, sizeof(void *) * a->chunks_capacity);
+            if (!a->chunks) {
+                FAIL_MESSAGE("Couldn't allocate memory for archetype chunks");
+            }
+        }
+        a->chunks[a->n_chunks] = malloc(a->chunk_size);
+        if (!a->chunks[a->n_chunks]) {
+            FAIL_MESSAGE("Couldn't allocate an archetype chunk");
+        }
+        a->n_chunks++;
+    }
+    return row;
+}
+
+// Fills the hole with the last row
+static void ecs_arch_remove_row(Ecs_World *w, Ecs_Archetype *a, uint32_t row)
+{
+    uint32_t last = --a->count;
+    if (row != last) {
+        for (int c = 0; c < a->n_columns; ++c) {
+            memcpy(ecs_arch_at(a, c, row), ecs_arch_at(a, c, last), a->sizes[c]);
+        }
+        Entity_t moved = *(Entity_t *) ecs_arch_at(a, 0, row);
+        w->entity_locations[moved >> ENTITY_ID_SHIFT].row = row;
+    }
+
+    // Keep one empty chunk, like dense pages do, so a count going back and
+    // forth over a chunk boundary doesn't free and malloc every time
+    uint32_t used = (a->count + a->rows_per_chunk - 1) / a->rows_per_chunk;
+    while (a->n_chunks > used + 1) {
+        free(a->chunks[--a->n_chunks]);
+    }
+}
+
+// Moves the entity's row, keeping the components both archetypes have
+static void ecs_arch_move(Ecs_World *w, uint32_t sparse_idx, uint32_t to)
+{
+    Ecs_Location *loc = &w->entity_locations[sparse_idx];
+    Ecs_Archetype *src = &w->archetypes[loc->archetype];
+    Ecs_Archetype *dst = &w->archetypes[to];
+
+    uint32_t row = 0;
+    if (to != ECS_ARCHETYPE_EMPTY) {
+        row = ecs_arch_push_row(dst);
+        for (int c = 0; c < dst->n_columns; ++c) {
+            int from = src->column_of[dst->ids[c]];
+            if (from >= 0) {
+                memcpy(ecs_arch_at(dst, c, row), ecs_arch_at(src, from, loc->row), dst->sizes[c]);
+            }
+        }
+    }
+    if (loc->archetype != ECS_ARCHETYPE_EMPTY) {
+        ecs_arch_remove_row(w, src, loc->row);
+    }
+
+    loc->archetype = to;
+    loc->row = row;
+}
+
+static uint32_t ecs_arch_edge(Ecs_World *w, uint32_t from, int id, bool add)
+{
+    Ecs_Archetype *a = &w->archetypes[from];
+    uint32_t *edge = add ? &a->add_edge[id] : &a->remove_edge[id];
+    if (*edge == ECS_ARCHETYPE_NONE) {
+        uint64_t mask[2] = { a->mask[0], a->mask[1] };
+        if (add) {
+            mask[id / 64] |= 1ULL << (id % 64);
+        } else {
+            mask[id / 64] &= ~(1ULL << (id % 64));
+        }
+        uint32_t to = ecs_arch_get(w, mask);
+        // The array may have moved
+        a = &w->archetypes[from];
+        edge = add ? &a->add_edge[id] : &a->remove_edge[id];
+        *edge = to;
+    }
+    return *edge;
+}
+
+static void* ecs_arch_get_component(Ecs_World *w, int id, Entity_t entity)
+{
+    uint32_t sparse_idx = entity >> ENTITY_ID_SHIFT;
+    if (!w->n_archetypes || sparse_idx >= w->entity_high_water) {
+        return NULL;
+    }
+
+    Ecs_Location *loc = &w->entity_locations[sparse_idx];
+    Ecs_Archetype *a = &w->archetypes[loc->archetype];
+    int column = a->column_of[id];
+    if (column < 0) {
+        return NULL;
+    }
+
+    Entity_t *e = (Entity_t *) ecs_arch_at(a, column, loc->row);
+    return (*e == entity) ? e : NULL;
+}
+
+static void* ecs_arch_new_component(Ecs_World *w, int id, Entity_t entity)
+{
+    ecs_arch_init(w);
+
+    uint32_t sparse_idx = entity >> ENTITY_ID_SHIFT;
+    Ecs_Location *loc = &w->entity_locations[sparse_idx];
+    if (w->archetypes[loc->archetype].column_of[id] < 0) {
+        ecs_arch_move(w, sparse_idx, ecs_arch_edge(w, loc->archetype, id, true));
+        w->component_lists[id].count++;
+    }
+
+    Ecs_Archetype *a = &w->archetypes[loc->archetype];
+    return ecs_arch_at(a, a->column_of[id], loc->row);
+}
+
+// Returns false if the entity didn't have the component
+static bool ecs_arch_remove_component(Ecs_World *w, int id, Entity_t entity)
+{
+    if (!ecs_arch_get_component(w, id, entity)) {
+        return false;
+    }
+
+    uint32_t sparse_idx = entity >> ENTITY_ID_SHIFT;
+    Ecs_Location *loc = &w->entity_locations[sparse_idx];
+    ecs_arch_move(w, sparse_idx, ecs_arch_edge(w, loc->archetype, id, false));
+    w->component_lists[id].count--;
+    return true;
+}
+
+// Drops the entity's whole row at once
+static void ecs_arch_detach(Ecs_World *w, uint32_t sparse_idx)
+{
+    Ecs_Location *loc = &w->entity_locations[sparse_idx];
+    if (!w->n_archetypes || loc->archetype == ECS_ARCHETYPE_EMPTY) {
+        return;
+    }
+
+    Ecs_Archetype *a = &w->archetypes[loc->archetype];
+    uint64_t *components = &w->entity_component_lists[sparse_idx * 2];
+    for (int c = 0; c < a->n_columns; ++c) {
+        w->component_lists[a->ids[c]].count--;
+    }
+    components[0] &= ~a->mask[0];
+    components[1] &= ~a->mask[1];
+    ecs_arch_move(w, sparse_idx, ECS_ARCHETYPE_EMPTY);
+}
+
+// Takes the purged lists out of every archetype
+static void ecs_arch_purge(Ecs_World *w, const uint64_t purged[2])
+{
+    for (uint32_t i = 1; i < w->n_archetypes; ++i) {
+        Ecs_Archetype *a = &w->archetypes[i];
+        if (!(a->mask[0] & purged[0]) && !(a->mask[1] & purged[1])) {
+            continue;
+        }
+
+        uint64_t mask[2] = { a->mask[0] & ~purged[0], a->mask[1] & ~purged[1] };
+        uint32_t to = ecs_arch_get(w, mask);
+        a = &w->archetypes[i];
+
+        // Move from the back, so no rows get shuffled around
+        while (a->count) {
+            Entity_t e = *(Entity_t *) ecs_arch_at(a, 0, a->count - 1);
+            ecs_arch_move(w, e >> ENTITY_ID_SHIFT, to);
+            a = &w->archetypes[i];
+        }
+    }
+}
+
+static void ecs_arch_deinit(Ecs_World *w)
+{
+    for (uint32_t i = 0; i < w->n_archetypes; ++i) {
+        Ecs_Archetype *a = &w->archetypes[i];
+        for (uint32_t c = 0; c < a->n_chunks; ++c) {
+            free(a->chunks[c]);
+        }
+        free(a->chunks);
+        free(a->ids);
+        free(a->offsets);
+        free(a->sizes);
+    }
+    free(w->archetypes);
+    free(w->archetype_table);
+    w->archetypes = NULL;
+    w->archetype_table = NULL;
+    w->n_archetypes = w->archetypes_capacity = w->archetype_table_capacity = 0;
+}
+
+void ecs_w_cl_init_sz(Ecs_World *w, int id, unsigned int element_size)
+{
+    Component_List *cl = &w->component_lists[id];
+    
+    // Set to 0
+    memset(cl, 0, sizeof(*cl));
+
+    cl->initialized = true;
+    cl->component_size = element_size;
+    cl->page_size = (size_t) DENSE_PAGE_SIZE * element_size + sizeof(Entity_t);
+
+    printf("New component list: (%d)\n", id);
+}
+
+void ecs_w_cl_init_soa(Ecs_World *w, int id, const unsigned int *field_sizes, int n_fields)
+{
+    if (n_fields < 1 || n_fields > ECS_SOA_MAX_FIELDS) {
+        FAIL_MESSAGE("Couldn't make the component list at index (%d) with %d fields, the limit is %d", id, n_fields, ECS_SOA_MAX_FIELDS);
+    }
+    ecs_w_cl_init_sz(w, id, sizeof(Entity_t));
+
+    Component_List *cl = &w->component_lists[id];
+    cl->n_fields = n_fields;
+
+    // Entities and the sentinel first, then the fields
+    size_t offset = cl->page_size;
+    for (int i = 0; i < n_fields; ++i) {
+        offset = (offset + 15) & ~(size_t) 15;
+        cl->field_sizes[i] = field_sizes[i];
+        cl->field_offsets[i] = offset;
+        offset += (size_t) DENSE_PAGE_SIZE * field_sizes[i];
+    }
+    cl->page_size = offset;
+}
+
+void ecs_w_cl_deinit(Ecs_World *w, int id)
+{
+    // Might have to use an internal arena for a component list.
+
+    Component_List *cl = &w->component_lists[id];
+    cl->initialized = false;
+
+    ecs_dense_trim(w, cl, 0);
+    ecs_sparse_clear(cl);
+    ecs_w_cl_track_changes(w, id, false);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Change tracking
+///////////////////////////////////////////////////////////////////////////////
+
+uint32_t ecs_w_frame(Ecs_World *w)
+{
+    return w->frame;
+}
+
+uint32_t ecs_w_advance_frame(Ecs_World *w)
+{
+    return ++w->frame;
+}
+
+static void ecs_changes_reset(Component_List *cl)
+{
+    for (unsigned int i = 0; i < SPARSE_PAGE_COUNT; ++i) {
+        free(cl->stamps[i]);
+        cl->stamps[i] = NULL;
+    }
+    cl->n_changes = 0;
+}
+
+void ecs_w_cl_track_changes(Ecs_World *w, int id, bool track)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (cl->track_changes == track) {
+        return;
+    }
+
+    if (track) {
+        os_mutex_init(&cl->changes_mutex);
+    } else {
+        ecs_changes_reset(cl);
+        free(cl->changes);
+        cl->changes = NULL;
+        cl->changes_capacity = 0;
+        os_mutex_deinit(&cl->changes_mutex);
+    }
+    cl->track_changes = track;
+}
+
+static void ecs_cl_mark_changed(Ecs_World *w, Component_List *cl, Entity_t entity)
+{
+    uint32_t sparse_idx = entity >> ENTITY_ID_SHIFT;
+    uint32_t **page = &cl->stamps[sparse_idx / SPARSE_PAGE_SIZE];
+
+    // Writing the same component again in a frame is the common case, and
+    // doesn't need the lock. Only the first change in a frame goes in the log.
+    uint32_t *stamps = (uint32_t *) ATOMIC_LOAD_PTR(page);
+    if (stamps && ATOMIC_LOAD_32(&stamps[sparse_idx % SPARSE_PAGE_SIZE]) == w->frame) {
+        return;
+    }
+
+    os_mutex_lock(&cl->changes_mutex);
+    if (!*page) {
+        stamps = (uint32_t *) calloc(SPARSE_PAGE_SIZE, sizeof(uint32_t));
+        if (!stamps) {
+            FAIL_MESSAGE("Couldn't allocate memory for change stamps");
+        }
+        ATOMIC_STORE_PTR(page, stamps);
+    }
+
+    // Another thread may have gotten here first
+    uint32_t *stamp = &(*page)[sparse_idx % SPARSE_PAGE_SIZE];
+    if (*stamp != w->frame) {
+        ATOMIC_STORE_32(stamp, w->frame);
+
+        if (cl->n_changes == cl->changes_capacity) {
+            cl->changes_capacity = cl->changes_capacity ? cl->changes_capacity * 2 : 256;
+            cl->changes = (Ecs_Change *) realloc(cl->changes, sizeof(Ecs_Change) * cl->changes_capacity);
+            if (!cl->changes) {
+                FAIL_MESSAGE("Couldn't grow the change log");
+            }
+        }
+        cl->changes[cl->n_changes].entity = entity;
+        cl->changes[cl->n_changes].frame = w->frame;
+        cl->n_changes++;
+    }
+    os_mutex_unlock(&cl->changes_mutex);
+}
+
+void ecs_w_mark_changed(Ecs_World *w, int id, Entity_t entity)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (cl->track_changes) {
+        ecs_cl_mark_changed(w, cl, entity);
+    }
+}
+
+void* ecs_w_write_component(Ecs_World *w, int id, Entity_t entity)
+{
+    void *result = ecs_w_get_component(w, id, entity);
+    ecs_w_mark_changed(w, id, entity);
+    return result;
+}
+
+void ecs_w_cl_trim_changes(Ecs_World *w, int id, uint32_t before_frame)
+{
+    Component_List *cl = &w->component_lists[id];
+
+    uint32_t keep = 0;
+    while (keep < cl->n_changes && cl->changes[keep].frame < before_frame) {
+        keep++;
+    }
+    memmove(cl->changes, cl->changes + keep, sizeof(Ecs_Change) * (cl->n_changes - keep));
+    cl->n_changes -= keep;
+}
+
+void ecs_w_changes_begin(Ecs_World *w, Ecs_Change_Iter *it, int id, uint32_t since_frame)
+{
+    Component_List *cl = &w->component_lists[id];
+    it->world = w;
+    it->id = id;
+    it->entity = 0;
+    it->component = NULL;
+
+    // The log is sorted by frame
+    uint32_t lo = 0, hi = cl->n_changes;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (cl->changes[mid].frame < since_frame) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    it->pos = lo;
+}
+
+bool ecs_changes_next(Ecs_Change_Iter *it)
+{
+    Ecs_World *w = it->world;
+    Component_List *cl = &w->component_lists[it->id];
+
+    while (it->pos < cl->n_changes) {
+        Ecs_Change *change = &cl->changes[it->pos++];
+        uint32_t sparse_idx = change->entity >> ENTITY_ID_SHIFT;
+
+        // A later change of the same component shows up later instead
+        if (cl->stamps[sparse_idx / SPARSE_PAGE_SIZE][sparse_idx % SPARSE_PAGE_SIZE] != change->frame) {
+            continue;
+        }
+        void *component = ecs_w_get_component_nullable(w, it->id, change->entity);
+        if (!component) {
+            // Removed since
+            continue;
+        }
+
+        it->entity = change->entity;
+        it->component = component;
+        return true;
+    }
+    return false;
+}
+
+static inline Entity_t* ecs_dense_at(Component_List *cl, Idx_t idx)
+{
+    return (Entity_t *) (
+        (char *) (cl->dense[idx / DENSE_PAGE_SIZE]) +
+        cl->component_size * (idx % DENSE_PAGE_SIZE)
+    );
+}
+
+static inline void* ecs_dense_field_at(Component_List *cl, Idx_t idx, int field)
+{
+    return (char *) (cl->dense[idx / DENSE_PAGE_SIZE]) + cl->field_offsets[field] +
+        (size_t) cl->field_sizes[field] * (idx % DENSE_PAGE_SIZE);
+}
+
+// Moves a component to another dense index, with all of its fields
+static void ecs_dense_copy(Component_List *cl, Idx_t dst, Idx_t src)
+{
+    memcpy(ecs_dense_at(cl, dst), ecs_dense_at(cl, src), cl->component_size);
+    for (int i = 0; i < cl->n_fields; ++i) {
+        memcpy(ecs_dense_field_at(cl, dst, i), ecs_dense_field_at(cl, src, i), cl->field_sizes[i]);
+    }
+}
+
+static void ecs_dense_clear(Component_List *cl, Idx_t idx)
+{
+    memset(ecs_dense_at(cl, idx), 0, cl->component_size);
+    for (int i = 0; i < cl->n_fields; ++i) {
+        memset(ecs_dense_field_at(cl, idx, i), 0, cl->field_sizes[i]);
+    }
+}
+
+
+static void ecs_dense_page_add(Ecs_World *w, Component_List *cl, uint32_t page)
+{
+    size_t sz = (size_t) DENSE_PAGE_SIZE * cl->component_size;
+    char *dense = (char *) ecs_page_alloc(w, cl);
+
+    // Recycled pages have old entities in them, and the iterators stop at
+    // the first empty slot
+    for (size_t i = 0; i < sz; i += cl->component_size) {
+        *(Entity_t *)(dense + i) = 0;
+    }
+    // I love pointer arithmetic
+    *(Entity_t *)(dense + sz) = (page + 1) << ENTITY_ID_SHIFT;
+    cl->dense[page] = dense;
+    cl->n_dense_pages++;
+}
+
+void* ecs_w_get_component_nullable(Ecs_World *w, int id, Entity_t entity)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (cl->archetype) {
+        return ecs_arch_get_component(w, id, entity);
+    }
+    Idx_t idx = ecs_sparse_get(cl, entity >> ENTITY_ID_SHIFT);
+
+    if (idx != SPARSE_NONE) {
+        // If there is something in the sparse check,
+        // that means there is something dense.
+        Entity_t *e = ecs_dense_at(cl, idx);
+        if (entity == *e) {
+            return e;
+        }
+    }
+    return NULL;
+}
+void* ecs_w_get_component(Ecs_World *w, int id, Entity_t entity)
+{
+    void *ret = ecs_w_get_component_nullable(w, id, entity);
+    if (!ret) {
+        FAIL_MESSAGE("Couldn't get the component at id (%d) from entity", id);
+    }
+    return ret;
+}
+
+void* ecs_w_new_component(Ecs_World *w, int id, Entity_t entity)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (!cl->initialized) {
+        FAIL_MESSAGE("Couldn't make a new component because the component list at index (%d) was not initialized!", id);
+    }
+
+    Entity_t sparse_idx = entity >> ENTITY_ID_SHIFT;
+    if (cl->archetype) {
+        void *result = ecs_arch_new_component(w, id, entity);
+        memset(result, 0, cl->component_size);
+        *(Entity_t *) result = entity;
+        w->entity_component_lists[sparse_idx*2 + id / 64] |= (1ULL << id % 64);
+        if (cl->track_changes) {
+            ecs_cl_mark_changed(w, cl, entity);
+        }
+        return result;
+    }
+
+    Idx_t *slot = ecs_sparse_slot(cl, sparse_idx);
+    Idx_t idx;
+    if (*slot != SPARSE_NONE) {
+        // Overwrite component if it already exists
+        idx = *slot;
+        printf("Overwriting component %x in list %d\n", entity, id);
+    } else {
+        // We need to calculate the push index and place dense
+        // components at the corresponding location
+        idx = cl->count;
+        *slot = idx;
+        if (idx % DENSE_PAGE_SIZE == 0 && !cl->dense[idx / DENSE_PAGE_SIZE]) {
+            ecs_dense_page_add(w, cl, idx / DENSE_PAGE_SIZE);
+        }
+        cl->count++;
+    }
+    
+    ecs_dense_clear(cl, idx);
+    void *result = ecs_dense_at(cl, idx);
+    *(Entity_t *) result = entity;
+    
+    w->entity_component_lists[sparse_idx*2 + id / 64] |= (1ULL << id % 64);
+    if (cl->track_changes) {
+        ecs_cl_mark_changed(w, cl, entity);
+    }
+
+    // We've now created the component
+
+    return result;
+}
+
+Idx_t ecs_w_new_components(Ecs_World *w, int id, const Entity_t *entities, uint32_t n, const void *data)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (!cl->initialized) {
+        FAIL_MESSAGE("Couldn't make new components because the component list at index (%d) was not initialized!", id);
+    }
+    if (data && cl->n_fields) {
+        FAIL_MESSAGE("Couldn't copy data for the struct-of-arrays component list at index (%d)", id);
+    }
+
+    size_t size = cl->component_size;
+    if (cl->archetype) {
+        // Every entity might be going to another archetype, one by one it is
+        for (uint32_t i = 0; i < n; ++i) {
+            char *component = (char *) ecs_w_new_component(w, id, entities[i]);
+            if (data) {
+                memcpy(component + sizeof(Entity_t), (const char *) data + size * i + sizeof(Entity_t), size - sizeof(Entity_t));
+            }
+        }
+        return (Idx_t) -1;
+    }
+
+    if (cl->count + n > MAX_ENTITIES) {
+        FAIL_MESSAGE("Couldn't fit %u more components in the component list at index (%d)", n, id);
+    }
+    Idx_t first = cl->count;
+    for (uint32_t page = first / DENSE_PAGE_SIZE; page * DENSE_PAGE_SIZE < first + n; ++page) {
+        if (!cl->dense[page]) {
+            ecs_dense_page_add(w, cl, page);
+        }
+    }
+
+    for (uint32_t i = 0; i < n; ++i) {
+        Entity_t sparse_idx = entities[i] >> ENTITY_ID_SHIFT;
+        Idx_t *slot = ecs_sparse_slot(cl, sparse_idx);
+        if (*slot != SPARSE_NONE) {
+            FAIL_MESSAGE("Entity %x already has a component in the list at index (%d)", entities[i], id);
+        }
+        *slot = first + i;
+        w->entity_component_lists[sparse_idx*2 + id / 64] |= (1ULL << id % 64);
+    }
+
+    // A block copy per page
+    for (uint32_t i = 0; i < n;) {
+        Idx_t idx = first + i;
+        uint32_t run = MIN(n - i, (uint32_t) (DENSE_PAGE_SIZE - idx % DENSE_PAGE_SIZE));
+
+        char *dst = (char *) ecs_dense_at(cl, idx);
+        if (data) {
+            memcpy(dst, (const char *) data + size * i, size * run);
+        } else {
+            memset(dst, 0, size * run);
+        }
+        for (int f = 0; f < cl->n_fields; ++f) {
+            memset(ecs_dense_field_at(cl, idx, f), 0, (size_t) cl->field_sizes[f] * run);
+        }
+        for (uint32_t j = 0; j < run; ++j) {
+            *(Entity_t *) (dst + size * j) = entities[i + j];
+        }
+        i += run;
+    }
+    cl->count += n;
+
+    if (cl->track_changes) {
+        for (uint32_t i = 0; i < n; ++i) {
+            ecs_cl_mark_changed(w, cl, entities[i]);
+        }
+    }
+    return first;
+}
+
+static void ecs_unreg_entity(Ecs_World *w, Entity_t entity);
+
+static void ecs_drop_component_bit(Ecs_World *w, int id, Entity_t entity)
+{
+    Entity_t sparse_idx = entity >> ENTITY_ID_SHIFT;
+    w->entity_component_lists[sparse_idx*2 + id/64] &= ~(1ULL << id % 64);
+    if (!w->entity_component_lists[sparse_idx*2] &&
+        !w->entity_component_lists[sparse_idx*2 + 1]) {
+        // Remove this entity if it doesn't have any more components
+        ecs_unreg_entity(w, entity);
+    }
+}
+
+// Takes the component out of the dense array. The entity's component
+// bits are left to the caller.
+static bool ecs_dense_remove(Ecs_World *w, Component_List *cl, Entity_t entity)
+{
+    Entity_t sparse_idx = entity >> ENTITY_ID_SHIFT;
+    Idx_t idx = ecs_sparse_get(cl, sparse_idx);
+
+    if (idx == SPARSE_NONE) {
+        return false;
+    }
+
+    Entity_t *dst = ecs_dense_at(cl, idx);
+    if (entity != *dst) {
+        // Deleting an older version
+        return false;
+    }
+    ecs_sparse_set(cl, sparse_idx, SPARSE_NONE);
+
+    // Deletion
+
+    if (cl->keep_ordering) {
+        *dst = 0;
+    } else {
+        cl->count -= 1;
+        if (idx != cl->count) {
+            // Do swap
+            Entity_t *src = ecs_dense_at(cl, cl->count);
+            ecs_dense_copy(cl, idx, cl->count);
+            Entity_t swapped = *dst;
+            ecs_sparse_set(cl, swapped >> ENTITY_ID_SHIFT, idx);
+            *src = 0;
+        } else {
+            *dst = 0;
+        }
+
+        if (cl->count % DENSE_PAGE_SIZE == 0) {
+            ecs_dense_shrink(w, cl);
+        }
+        cl->deleted_component = true;
+    }
+    return true;
+}
+
+void ecs_w_remove_component(Ecs_World *w, int id, Entity_t entity)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (cl->archetype) {
+        if (ecs_arch_remove_component(w, id, entity)) {
+            ecs_drop_component_bit(w, id, entity);
+        }
+        return;
+    }
+
+    if (ecs_dense_remove(w, cl, entity)) {
+        ecs_drop_component_bit(w, id, entity);
+    }
+}
+
+void ecs_w_cl_ordered_clean(Ecs_World *w, int id)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (cl->archetype) {
+        // Archetype rows never have holes
+        return;
+    }
+
+    int src_idx, dst_idx;
+    src_idx = dst_idx = 0;
+    
+    for (unsigned int i = 0; i < cl->count; ++i) {
+        Entity_t *src = ecs_dense_at(cl, src_idx);
+        if (*src) {
+            if (src_idx != dst_idx) {
+                Entity_t *dst = ecs_dense_at(cl, dst_idx);
+                ecs_dense_copy(cl, dst_idx, src_idx);
+                *src = 0;
+                ecs_sparse_set(cl, *dst >> ENTITY_ID_SHIFT, dst_idx);
+            }
+            dst_idx++;
+        }
+        src_idx++;
+    }
+
+    cl->count = dst_idx;
+    ecs_dense_shrink(w, cl);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sorting
+//
+// Every component gets a key, the keys get sorted, and then the components
+// move along the cycles of the new order, so each one gets copied once and
+// its sparse index gets fixed right there. Components already in place
+// don't move at all.
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct Ecs_Sort_Entry {
+    uint64_t key;
+    uint32_t idx;
+} Ecs_Sort_Entry;
+
+typedef enum Ecs_Sort_Kind {
+    ECS_SORT_ENTITY,
+    ECS_SORT_KEY,
+    ECS_SORT_LIKE,
+} Ecs_Sort_Kind;
+
+// Where the first run of keys in order, starting at begin, ends
+static uint32_t ecs_sort_run_end(const Ecs_Sort_Entry *entries, uint32_t begin, uint32_t n)
+{
+    uint32_t end = begin + 1;
+    while (end < n && entries[end - 1].key <= entries[end].key) {
+        end++;
+    }
+    return end;
+}
+
+// Natural merge sort. It's stable, and it merges the runs that are in
+// order already, so a list that's mostly sorted takes a pass or two.
+// Returns the buffer with the result, entries or tmp.
+static Ecs_Sort_Entry* ecs_sort_entries(Ecs_Sort_Entry *entries, Ecs_Sort_Entry *tmp, uint32_t n)
+{
+    Ecs_Sort_Entry *src = entries;
+    Ecs_Sort_Entry *dst = tmp;
+    if (n == 0 || ecs_sort_run_end(src, 0, n) == n) {
+        return src;
+    }
+
+    for (;;) {
+        uint32_t runs = 0;
+        for (uint32_t begin = 0; begin < n; runs++) {
+            uint32_t mid = ecs_sort_run_end(src, begin, n);
+            uint32_t end = mid < n ? ecs_sort_run_end(src, mid, n) : n;
+
+            uint32_t a = begin, b = mid, out = begin;
+            while (a < mid && b < end) {
+                // Ties take from the left to stay stable
+                dst[out++] = (src[b].key < src[a].key) ? src[b++] : src[a++];
+            }
+            while (a < mid) {
+                dst[out++] = src[a++];
+            }
+            while (b < end) {
+                dst[out++] = src[b++];
+            }
+            begin = end;
+        }
+
+        Ecs_Sort_Entry *swap = src;
+        src = dst;
+        dst = swap;
+        if (runs == 1) {
+            return src;
+        }
+    }
+}
+
+// Copies a component and its fields out of the dense pages, and back in
+static void ecs_dense_save(Component_List *cl, Idx_t idx, char *out)
+{
+    memcpy(out, ecs_dense_at(cl, idx), cl->component_size);
+    out += cl->component_size;
+    for (int i = 0; i < cl->n_fields; ++i) {
+        memcpy(out, ecs_dense_field_at(cl, idx, i), cl->field_sizes[i]);
+        out += cl->field_sizes[i];
+    }
+}
+
+static void ecs_dense_load(Component_List *cl, Idx_t idx, const char *in)
+{
+    memcpy(ecs_dense_at(cl, idx), in, cl->component_size);
+    in += cl->component_size;
+    for (int i = 0; i < cl->n_fields; ++i) {
+        memcpy(ecs_dense_field_at(cl, idx, i), in, cl->field_sizes[i]);
+        in += cl->field_sizes[i];
+    }
+}
+
+static uint32_t ecs_cl_sort(Ecs_World *w, int id, Ecs_Sort_Kind kind, Ecs_Sort_Key key, void *arg, int like_id)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (!cl->initialized) {
+        FAIL_MESSAGE("Couldn't sort the component list at index (%d), it was not initialized", id);
+    }
+    if (cl->archetype) {
+        FAIL_MESSAGE("The component list at index (%d) is stored in archetypes, it can't be sorted", id);
+    }
+    Component_List *like = NULL;
+    if (kind == ECS_SORT_LIKE) {
+        like = &w->component_lists[like_id];
+        if (!like->initialized || like->archetype) {
+            FAIL_MESSAGE("Couldn't sort the component list at index (%d) like the one at index (%d)", id, like_id);
+        }
+    }
+
+    uint32_t n = cl->count;
+    if (n * 2 > w->sort_entries_capacity) {
+        free(w->sort_entries);
+        w->sort_entries = (Ecs_Sort_Entry *) malloc(sizeof(Ecs_Sort_Entry) * n * 2);
+        if (!w->sort_entries) {
+            FAIL_MESSAGE("Couldn't allocate memory for sorting the component list at index (%d)", id);
+        }
+        w->sort_entries_capacity = n * 2;
+    }
+    size_t slot_size = cl->component_size;
+    for (int i = 0; i < cl->n_fields; ++i) {
+        slot_size += cl->field_sizes[i];
+    }
+    if (slot_size > w->sort_slot_size) {
+        free(w->sort_slot);
+        w->sort_slot = (char *) malloc(slot_size);
+        if (!w->sort_slot) {
+            FAIL_MESSAGE("Couldn't allocate memory for sorting the component list at index (%d)", id);
+        }
+        w->sort_slot_size = slot_size;
+    }
+
+    // Holes from ecs_cl_keep_ordering() go to the end, and get dropped
+    uint32_t n_live = 0;
+    Ecs_Sort_Entry *entries = w->sort_entries;
+    for (uint32_t i = 0; i < n; ++i) {
+        const Entity_t *component = ecs_dense_at(cl, i);
+        Entity_t e = *component;
+        uint64_t k = UINT64_MAX;
+        if (e) {
+            n_live++;
+            if (kind == ECS_SORT_ENTITY) {
+                k = e >> ENTITY_ID_SHIFT;
+            } else if (kind == ECS_SORT_KEY) {
+                // Keeps the holes behind every key
+                k = MIN(key(component, arg), UINT64_MAX - 1);
+            } else {
+                // Entities without the other component go after the ones
+                // with it, in the order they were in
+                Idx_t other = ecs_sparse_get(like, e >> ENTITY_ID_SHIFT);
+                k = (other != SPARSE_NONE) ? other : (uint64_t) MAX_ENTITIES + i;
+            }
+        }
+        entries[i].key = k;
+        entries[i].idx = i;
+    }
+    entries = ecs_sort_entries(entries, w->sort_entries + n, n);
+
+    // entries[i].idx is where the component that goes at i is now
+    uint32_t moved = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (entries[i].idx == i) {
+            continue;
+        }
+
+        ecs_dense_save(cl, i, w->sort_slot);
+        uint32_t dst = i;
+        for (uint32_t src = entries[i].idx; src != i; src = entries[dst].idx) {
+            ecs_dense_copy(cl, dst, src);
+            Entity_t e = *ecs_dense_at(cl, dst);
+            if (e) {
+                ecs_sparse_set(cl, e >> ENTITY_ID_SHIFT, dst);
+            }
+            entries[dst].idx = dst;
+            moved++;
+            dst = src;
+        }
+        ecs_dense_load(cl, dst, w->sort_slot);
+        Entity_t e = *ecs_dense_at(cl, dst);
+        if (e) {
+            ecs_sparse_set(cl, e >> ENTITY_ID_SHIFT, dst);
+        }
+        entries[dst].idx = dst;
+        moved++;
+    }
+
+    if (n_live != n) {
+        cl->count = n_live;
+        ecs_dense_shrink(w, cl);
+    }
+    return moved;
+}
+
+uint32_t ecs_w_cl_sort_by_entity(Ecs_World *w, int id)
+{
+    return ecs_cl_sort(w, id, ECS_SORT_ENTITY, NULL, NULL, -1);
+}
+
+uint32_t ecs_w_cl_sort_by_key(Ecs_World *w, int id, Ecs_Sort_Key key, void *arg)
+{
+    return ecs_cl_sort(w, id, ECS_SORT_KEY, key, arg, -1);
+}
+
+uint32_t ecs_w_cl_sort_like(Ecs_World *w, int id, int like_id)
+{
+    if (id == like_id) {
+        return 0;
+    }
+    return ecs_cl_sort(w, id, ECS_SORT_LIKE, NULL, NULL, like_id);
+}
+
+Idx_t ecs_w_cl_count(Ecs_World *w, int id)
+{
+    Component_List *cl = &w->component_lists[id];
+    return cl->count;
+}
+
+void* ecs_w_cl_at(Ecs_World *w, int id, Idx_t index)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (cl->archetype) {
+        FAIL_MESSAGE("The component list at index (%d) is stored in archetypes, use a query instead", id);
+    }
+    return ecs_dense_at(cl, index);
+}
+
+void* ecs_w_cl_begin(Ecs_World *w, int id)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (cl->archetype) {
+        FAIL_MESSAGE("The component list at index (%d) is stored in archetypes, use a query instead", id);
+    }
+    cl->deleted_component = false;
+    return cl->dense[0];
+}
+
+void* ecs_w_cl_next(Ecs_World *w, int id, void *iter)
+{
+    Component_List *cl = &w->component_lists[id];
+
+    Entity_t *next = 0;
+    if (cl->deleted_component) {
+        cl->deleted_component = false;
+        if (!cl->count) {
+            return NULL;
+        }
+        next = (Entity_t *) iter;
+    } else {
+        next = (Entity_t *)((char *) iter + cl->component_size);
+    }
+
+    if (!(*next & ENTITY_VERSION_MASK)) {
+        if (*next & ENTITY_ID_MASK) {
+            Idx_t dense_idx = *next >> ENTITY_ID_SHIFT;
+            next = (Entity_t *) cl->dense[dense_idx];
+            // The list's spare page, if it's there, is empty
+            if (next && !*next) {
+                return NULL;
+            }
+        } else {
+            return NULL;
+        }
+    }
+
+    return next;
+}
+
+uint32_t ecs_w_soa_page_count(Ecs_World *w, int id)
+{
+    Component_List *cl = &w->component_lists[id];
+    return (cl->count + DENSE_PAGE_SIZE - 1) / DENSE_PAGE_SIZE;
+}
+
+void* ecs_w_soa_column(Ecs_World *w, int id, uint32_t page, int field, uint32_t *count)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (field < ECS_SOA_ENTITIES || field >= cl->n_fields) {
+        FAIL_MESSAGE("The component list at index (%d) doesn't have field %d", id, field);
+    }
+    uint32_t begin = page * DENSE_PAGE_SIZE;
+    *count = begin < cl->count ? MIN((uint32_t) DENSE_PAGE_SIZE, cl->count - begin) : 0;
+    if (!*count) {
+        return NULL;
+    }
+
+    char *dense = (char *) cl->dense[page];
+    return field == ECS_SOA_ENTITIES ? dense : dense + cl->field_offsets[field];
+}
+
+void* ecs_w_soa_field(Ecs_World *w, int id, Entity_t entity, int field)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (field < 0 || field >= cl->n_fields) {
+        FAIL_MESSAGE("The component list at index (%d) doesn't have field %d", id, field);
+    }
+    Idx_t idx = ecs_sparse_get(cl, entity >> ENTITY_ID_SHIFT);
+    if (idx == SPARSE_NONE || *ecs_dense_at(cl, idx) != entity) {
+        return NULL;
+    }
+    return ecs_dense_field_at(cl, idx, field);
+}
+
+void ecs_w_query_init(Ecs_World *w, Ecs_Query *self, const int *ids, int n_ids)
+{
+    if (n_ids <= 0 || n_ids > ECS_QUERY_MAX_COMPONENTS) {
+        FAIL_MESSAGE("A query needs between 1 and %d components, got %d", ECS_QUERY_MAX_COMPONENTS, n_ids);
+    }
+
+    memset(self, 0, sizeof(*self));
+    self->world = w;
+    self->n_ids = n_ids;
+    for (int i = 0; i < n_ids; ++i) {
+        if (!w->component_lists[ids[i]].initialized) {
+            FAIL_MESSAGE("Couldn't query the component list at index (%d), it was not initialized!", ids[i]);
+        }
+        self->ids[i] = ids[i];
+        self->mask[ids[i] / 64] |= 1ULL << (ids[i] % 64);
+    }
+    ecs_query_reset(self);
+}
+
+void ecs_query_reset(Ecs_Query *self)
+{
+    Ecs_World *w = self->world;
+    // Only lists with their own dense pages can drive the walk.
+    // With none of those, the walk goes over the matching archetypes.
+    self->driver = -1;
+    for (int i = 0; i < self->n_ids; ++i) {
+        Component_List *cl = &w->component_lists[self->ids[i]];
+        if (!cl->archetype &&
+            (self->driver < 0 || cl->count < w->component_lists[self->ids[self->driver]].count)) {
+            self->driver = i;
+        }
+    }
+    self->by_archetype = self->driver < 0;
+    self->archetype = 0;
+    self->index = 0;
+    self->entity = 0;
+}
+
+static bool ecs_query_next_archetype(Ecs_Query *self)
+{
+    Ecs_World *w = self->world;
+    for (; self->archetype < w->n_archetypes; self->archetype++, self->index = 0) {
+        Ecs_Archetype *a = &w->archetypes[self->archetype];
+        if (self->index >= a->count ||
+            (a->mask[0] & self->mask[0]) != self->mask[0] ||
+            (a->mask[1] & self->mask[1]) != self->mask[1]) {
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+uint32_t ecs_query_next_chunk(Ecs_Query *self)
+{
+    Ecs_World *w = self->world;
+    if (!self->by_archetype) {
+        FAIL_MESSAGE("Only queries over archetype lists can be walked by chunks");
+    }
+    if (!ecs_query_next_archetype(self)) {
+        return 0;
+    }
+
+    Ecs_Archetype *a = &w->archetypes[self->archetype];
+    uint32_t rows = MIN(a->rows_per_chunk - self->index % a->rows_per_chunk, a->count - self->index);
+    for (int i = 0; i < self->n_ids; ++i) {
+        self->components[i] = ecs_arch_at(a, a->column_of[self->ids[i]], self->index);
+    }
+    self->entity = *(Entity_t *) self->components[0];
+    self->index += rows;
+    return rows;
+}
+
+bool ecs_query_next(Ecs_Query *self)
+{
+    Ecs_World *w = self->world;
+    if (self->by_archetype) {
+        if (!ecs_query_next_archetype(self)) {
+            return false;
+        }
+
+        Ecs_Archetype *a = &w->archetypes[self->archetype];
+        for (int i = 0; i < self->n_ids; ++i) {
+            self->components[i] = ecs_arch_at(a, a->column_of[self->ids[i]], self->index);
+        }
+        self->entity = *(Entity_t *) self->components[0];
+        self->index++;
+        return true;
+    }
+
+    Component_List *driver = &w->component_lists[self->ids[self->driver]];
+
+    while (self->index < driver->count) {
+        Entity_t *e = ecs_dense_at(driver, self->index++);
+        if (!*e) {
+            // A hole left by keep_ordering
+            continue;
+        }
+
+        // The entity's component mask says right away if it has the rest
+        uint32_t sparse_idx = *e >> ENTITY_ID_SHIFT;
+        uint64_t *has = &w->entity_component_lists[sparse_idx * 2];
+        if ((has[0] & self->mask[0]) != self->mask[0] ||
+            (has[1] & self->mask[1]) != self->mask[1]) {
+            continue;
+        }
+
+        for (int i = 0; i < self->n_ids; ++i) {
+            Component_List *cl = &w->component_lists[self->ids[i]];
+            if (i == self->driver) {
+                self->components[i] = e;
+            } else if (cl->archetype) {
+                Ecs_Location *loc = &w->entity_locations[sparse_idx];
+                Ecs_Archetype *a = &w->archetypes[loc->archetype];
+                self->components[i] = ecs_arch_at(a, a->column_of[self->ids[i]], loc->row);
+            } else {
+                self->components[i] = ecs_dense_at(cl, ecs_sparse_get(cl, sparse_idx));
+            }
+        }
+        self->entity = *e;
+        return true;
+    }
+    return false;
+}
+
+// Flag sets
+void ecs_w_cl_allow_purge(Ecs_World *w, int id, bool allow)
+{
+    Component_List *cl = &w->component_lists[id];
+    // The pages already there came from wherever the old flag said, and
+    // the scene arena would get cleared under a list that isn't purged
+    if (cl->no_purge != !allow && cl->n_dense_pages) {
+        FAIL_MESSAGE("Couldn't change purging of the component list at index (%d), it already has dense pages", id);
+    }
+    cl->no_purge = !allow;
+}
+void ecs_w_cl_keep_ordering(Ecs_World *w, int id, bool keep)
+{
+    Component_List *cl = &w->component_lists[id];
+    cl->keep_ordering = keep;
+}
+void ecs_w_cl_use_archetypes(Ecs_World *w, int id, bool use)
+{
+    Component_List *cl = &w->component_lists[id];
+    if (cl->count) {
+        FAIL_MESSAGE("Couldn't change the storage of the component list at index (%d), it already has components", id);
+    }
+    if (use && cl->n_fields) {
+        FAIL_MESSAGE("The component list at index (%d) is struct-of-arrays, it can't use archetypes", id);
+    }
+    cl->archetype = use;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Command buffers
+///////////////////////////////////////////////////////////////////////////////
+
+// Created entities have version 0, which real entities never get
+#define ECS_COMMAND_PLACEHOLDER(e) (((e) & ENTITY_VERSION_MASK) == 0)
+
+typedef struct Ecs_Command_Ref {
+    Ecs_Command *command;
+    // Where it was in the recording, so order breaks ties
+    uint32_t seq;
+} Ecs_Command_Ref;
+
+// Each thread's buffer for each world
+typedef struct Ecs_Thread_Commands {
+    uint32_t serial;
+    Ecs_Command_Buffer *buffer;
+} Ecs_Thread_Commands;
+
+static THREAD_LOCAL Ecs_Thread_Commands _thread_commands[ECS_MAX_WORLDS];
+
+void ecs_w_commands_init(Ecs_World *w, Ecs_Command_Buffer *self)
+{
+    memset(self, 0, sizeof(*self));
+    self->world = w;
+    self->arena = arena_alloc();
+}
+
+void ecs_commands_deinit(Ecs_Command_Buffer *self)
+{
+    if (self->arena) {
+        arena_release(self->arena);
+    }
+    memset(self, 0, sizeof(*self));
+}
+
+static Ecs_Command* ecs_cmd_push(Ecs_Command_Buffer *self, Ecs_Command_Kind kind, int id, Entity_t entity)
+{
+    if (!self->last || self->last->count == ECS_COMMAND_BLOCK_SIZE) {
+        Ecs_Command_Block *block = (Ecs_Command_Block *) arena_push(self->arena, sizeof(Ecs_Command_Block), 8);
+        block->count = 0;
+        block->next = NULL;
+        if (self->last) {
+            self->last->next = block;
+        } else {
+            self->first = block;
+        }
+        self->last = block;
+    }
+
+    Ecs_Command *cmd = &self->last->commands[self->last->count++];
+    cmd->kind = (uint8_t) kind;
+    cmd->id = (uint8_t) id;
+    cmd->entity = entity;
+    cmd->data = NULL;
+    self->count++;
+    return cmd;
+}
+
+Entity_t ecs_cmd_create(Ecs_Command_Buffer *self)
+{
+    Entity_t placeholder = self->n_created++ << ENTITY_ID_SHIFT;
+    ecs_cmd_push(self, ECS_COMMAND_CREATE, 0, placeholder);
+    return placeholder;
+}
+
+void ecs_cmd_add(Ecs_Command_Buffer *self, int id, Entity_t entity, const void *data)
+{
+    Ecs_World *w = self->world;
+    if (data && w->component_lists[id].n_fields) {
+        FAIL_MESSAGE("Couldn't copy data for the struct-of-arrays component list at index (%d)", id);
+    }
+    Ecs_Command *cmd = ecs_cmd_push(self, ECS_COMMAND_ADD, id, entity);
+    if (data) {
+        unsigned int size = w->component_lists[id].component_size;
+        cmd->data = arena_push(self->arena, size, 16);
+        memcpy(cmd->data, data, size);
+    }
+}
+
+void ecs_cmd_remove(Ecs_Command_Buffer *self, int id, Entity_t entity)
+{
+    ecs_cmd_push(self, ECS_COMMAND_REMOVE, id, entity);
+}
+
+void ecs_cmd_delete(Ecs_Command_Buffer *self, Entity_t entity)
+{
+    ecs_cmd_push(self, ECS_COMMAND_DELETE, 0, entity);
+}
+
+static int ecs_command_order(const void *a, const void *b)
+{
+    const Ecs_Command_Ref *x = (const Ecs_Command_Ref *) a;
+    const Ecs_Command_Ref *y = (const Ecs_Command_Ref *) b;
+
+    // Deletes after everything else
+    bool x_delete = x->command->kind == ECS_COMMAND_DELETE;
+    bool y_delete = y->command->kind == ECS_COMMAND_DELETE;
+    if (x_delete != y_delete) {
+        return x_delete ? 1 : -1;
+    }
+    if (x->command->id != y->command->id) {
+        return x->command->id < y->command->id ? -1 : 1;
+    }
+    if (x->command->entity != y->command->entity) {
+        return x->command->entity < y->command->entity ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+void ecs_commands_apply(Ecs_Command_Buffer **buffers, int n_buffers)
+{
+    if (n_buffers <= 0) {
+        return;
+    }
+    Ecs_World *w = buffers[0]->world;
+    uint32_t total = 0;
+    for (int b = 0; b < n_buffers; ++b) {
+        if (buffers[b]->world != w) {
+            FAIL_MESSAGE("Couldn't apply command buffers of different worlds together");
+        }
+        total += buffers[b]->count;
+    }
+    if (total > w->command_refs_capacity) {
+        free(w->command_refs);
+        w->command_refs = (Ecs_Command_Ref *) malloc(sizeof(Ecs_Command_Ref) * total);
+        if (!w->command_refs) {
+            FAIL_MESSAGE("Couldn't allocate memory for applying commands");
+        }
+        w->command_refs_capacity = total;
+    }
+
+    // Create the new entities first, and point the commands at them.
+    // The placeholder IDs count up, so they index straight into the list.
+    uint32_t n_refs = 0;
+    for (int b = 0; b < n_buffers; ++b) {
+        Ecs_Command_Buffer *buf = buffers[b];
+        Entity_t *created = NULL;
+        if (buf->n_created) {
+            created = (Entity_t *) arena_push(buf->arena, sizeof(Entity_t) * buf->n_created, 4);
+        }
+
+        for (Ecs_Command_Block *block = buf->first; block; block = block->next) {
+            for (uint32_t i = 0; i < block->count; ++i) {
+                Ecs_Command *cmd = &block->commands[i];
+                if (cmd->kind == ECS_COMMAND_CREATE) {
+                    created[cmd->entity >> ENTITY_ID_SHIFT] = ecs_w_new_entity(w);
+                    continue;
+                }
+                if (ECS_COMMAND_PLACEHOLDER(cmd->entity)) {
+                    cmd->entity = created[cmd->entity >> ENTITY_ID_SHIFT];
+                }
+                w->command_refs[n_refs].command = cmd;
+                w->command_refs[n_refs].seq = n_refs;
+                n_refs++;
+            }
+        }
+    }
+
+    qsort(w->command_refs, n_refs, sizeof(Ecs_Command_Ref), ecs_command_order);
+
+    // Adds go before removes, so an entity can't run out of components
+    // (and get freed) while it's still getting new ones
+    for (int pass = 0; pass < 2; ++pass) {
+        for (uint32_t i = 0; i < n_refs; ++i) {
+            Ecs_Command *cmd = w->command_refs[i].command;
+            if (cmd->kind == ECS_COMMAND_DELETE) {
+                break;
+            }
+            // Only the last command for the same component counts
+            if (i + 1 < n_refs) {
+                Ecs_Command *next = w->command_refs[i + 1].command;
+                if (next->kind != ECS_COMMAND_DELETE && next->id == cmd->id && next->entity == cmd->entity) {
+                    continue;
+                }
+            }
+
+            if (pass == 0 && cmd->kind == ECS_COMMAND_ADD) {
+                Component_List *cl = &w->component_lists[cmd->id];
+                void *component = ecs_w_new_component(w, cmd->id, cmd->entity);
+                if (cmd->data) {
+                    memcpy(component, cmd->data, cl->component_size);
+                    *(Entity_t *) component = cmd->entity;
+                }
+            } else if (pass == 1 && cmd->kind == ECS_COMMAND_REMOVE) {
+                ecs_w_remove_component(w, cmd->id, cmd->entity);
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < n_refs; ++i) {
+        Ecs_Command *cmd = w->command_refs[i].command;
+        if (cmd->kind == ECS_COMMAND_DELETE) {
+            ecs_w_delete_entity(w, cmd->entity);
+        }
+    }
+
+    for (int b = 0; b < n_buffers; ++b) {
+        Ecs_Command_Buffer *buf = buffers[b];
+        arena_clear(buf->arena);
+        buf->first = buf->last = NULL;
+        buf->count = 0;
+        buf->n_created = 0;
+    }
+}
+
+Ecs_Command_Buffer* ecs_w_thread_commands(Ecs_World *w)
+{
+    // A buffer left by a destroyed world in the same slot got freed with it
+    Ecs_Thread_Commands *tc = &_thread_commands[w->slot];
+    if (tc->serial == w->serial && tc->buffer) {
+        return tc->buffer;
+    }
+
+    Ecs_Command_Buffer *buffer = (Ecs_Command_Buffer *) malloc(sizeof(Ecs_Command_Buffer));
+    if (!buffer) {
+        FAIL_MESSAGE("Couldn't allocate a command buffer");
+    }
+    ecs_w_commands_init(w, buffer);
+
+    os_mutex_lock(&w->thread_commands_mutex);
+    if (w->n_thread_commands == w->thread_commands_capacity) {
+        w->thread_commands_capacity = w->thread_commands_capacity ? w->thread_commands_capacity * 2 : 16;
+        w->thread_commands = (Ecs_Command_Buffer **) realloc(w->thread_commands,
+            sizeof(Ecs_Command_Buffer *) * w->thread_commands_capacity);
+        if (!w->thread_commands) {
+            FAIL_MESSAGE("Couldn't grow the list of command buffers");
+        }
+    }
+    w->thread_commands[w->n_thread_commands++] = buffer;
+    os_mutex_unlock(&w->thread_commands_mutex);
+
+    tc->serial = w->serial;
+    tc->buffer = buffer;
+    return buffer;
+}
+
+void ecs_w_commands_sync(Ecs_World *w)
+{
+    if (!w->n_thread_commands) {
+        return;
+    }
+
+    os_mutex_lock(&w->thread_commands_mutex);
+    ecs_commands_apply(w->thread_commands, (int) w->n_thread_commands);
+    os_mutex_unlock(&w->thread_commands_mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Systems
+///////////////////////////////////////////////////////////////////////////////
+
+void ecs_w_scheduler_init(Ecs_World *w, Ecs_Scheduler *self, Job_System *jobs)
+{
+    memset(self, 0, sizeof(*self));
+    self->world = w;
+    self->jobs = jobs;
+}
+
+void ecs_scheduler_deinit(Ecs_Scheduler *self)
+{
+    free(self->tasks);
+    memset(self, 0, sizeof(*self));
+}
+
+static void ecs_mask_set(uint64_t mask[2], const int *ids, int n_ids)
+{
+    for (int i = 0; i < n_ids; ++i) {
+        mask[ids[i] / 64] |= 1ULL << (ids[i] % 64);
+    }
+}
+
+int ecs_system_add(Ecs_Scheduler *self, const Ecs_System_Desc *desc)
+{
+    Ecs_World *w = self->world;
+    if (self->n_systems == ECS_MAX_SYSTEMS) {
+        FAIL_MESSAGE("Couldn't add a system, there are already %d", ECS_MAX_SYSTEMS);
+    }
+    if (desc->split_by >= 0 && w->component_lists[desc->split_by].archetype) {
+        FAIL_MESSAGE("Couldn't split a system by the component list at index (%d), it's stored in archetypes", desc->split_by);
+    }
+
+    int index = self->n_systems++;
+    Ecs_System *sys = &self->systems[index];
+    memset(sys, 0, sizeof(*sys));
+    sys->fn = desc->fn;
+    sys->arg = desc->arg;
+    sys->split_by = desc->split_by;
+    sys->main_thread = desc->main_thread;
+    sys->enabled = true;
+
+    ecs_mask_set(sys->reads, desc->reads, desc->n_reads);
+    ecs_mask_set(sys->writes, desc->writes, desc->n_writes);
+    return index;
+}
+
+void ecs_system_enable(Ecs_Scheduler *self, int index, bool enable)
+{
+    self->systems[index].enabled = enable;
+}
+
+static bool ecs_systems_conflict(Ecs_System *a, Ecs_System *b)
+{
+    for (int i = 0; i < 2; ++i) {
+        if ((a->writes[i] & (b->reads[i] | b->writes[i])) || (a->reads[i] & b->writes[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t ecs_system_range(Ecs_World *w, Ecs_System *sys)
+{
+    return sys->split_by >= 0 ? w->component_lists[sys->split_by].count : 1;
+}
+
+static void ecs_system_job(void *arg)
+{
+    Job_Range *task = (Job_Range *) arg;
+    task->fn(task->arg, task->begin, task->end);
+}
+
+static void ecs_scheduler_run_wave(Ecs_Scheduler *self, uint64_t wave)
+{
+    Ecs_World *w = self->world;
+    // Count the jobs first, so the task array doesn't move under the workers
+    uint32_t n_tasks = 0;
+    for (int i = 0; i < self->n_systems; ++i) {
+        Ecs_System *sys = &self->systems[i];
+        if ((wave & (1ULL << i)) && !sys->main_thread) {
+            n_tasks += MAX(1u, (ecs_system_range(w, sys) + DENSE_PAGE_SIZE - 1) / DENSE_PAGE_SIZE);
+        }
+    }
+    if (n_tasks > self->tasks_capacity) {
+        free(self->tasks);
+        self->tasks = (Job_Range *) malloc(sizeof(Job_Range) * n_tasks);
+        if (!self->tasks) {
+            FAIL_MESSAGE("Couldn't allocate system jobs");
+        }
+        self->tasks_capacity = n_tasks;
+    }
+
+    Job_Counter counter = { 0 };
+    uint32_t t = 0;
+    for (int i = 0; i < self->n_systems; ++i) {
+        Ecs_System *sys = &self->systems[i];
+        if (!(wave & (1ULL << i)) || sys->main_thread) {
+            continue;
+        }
+
+        // One job per dense page
+        uint32_t count = ecs_system_range(w, sys);
+        uint32_t begin = 0;
+        do {
+            Job_Range *task = &self->tasks[t++];
+            task->fn = sys->fn;
+            task->arg = sys->arg;
+            task->begin = begin;
+            task->end = MIN(count, begin + DENSE_PAGE_SIZE);
+            jobs_submit(self->jobs, ecs_system_job, task, &counter);
+            begin = task->end;
+        } while (begin < count);
+    }
+
+    for (int i = 0; i < self->n_systems; ++i) {
+        Ecs_System *sys = &self->systems[i];
+        if ((wave & (1ULL << i)) && sys->main_thread) {
+            sys->fn(sys->arg, 0, ecs_system_range(w, sys));
+        }
+    }
+
+    jobs_wait(self->jobs, &counter);
+}
+
+void ecs_scheduler_run(Ecs_Scheduler *self)
+{
+    Ecs_World *w = self->world;
+    if (!self->jobs) {
+        for (int i = 0; i < self->n_systems; ++i) {
+            Ecs_System *sys = &self->systems[i];
+            if (sys->enabled) {
+                sys->fn(sys->arg, 0, ecs_system_range(w, sys));
+            }
+        }
+        ecs_w_commands_sync(w);
+        return;
+    }
+
+    // Each system waits for the earlier systems it conflicts with
+    uint64_t deps[ECS_MAX_SYSTEMS];
+    uint64_t pending = 0;
+    for (int j = 0; j < self->n_systems; ++j) {
+        Ecs_System *sys = &self->systems[j];
+        if (!sys->enabled) {
+            continue;
+        }
+        pending |= 1ULL << j;
+        deps[j] = 0;
+        for (int i = 0; i < j; ++i) {
+            if (self->systems[i].enabled && ecs_systems_conflict(&self->systems[i], sys)) {
+                deps[j] |= 1ULL << i;
+            }
+        }
+    }
+
+    while (pending) {
+        uint64_t wave = 0;
+        for (int j = 0; j < self->n_systems; ++j) {
+            if ((pending & (1ULL << j)) && !(deps[j] & pending)) {
+                wave |= 1ULL << j;
+            }
+        }
+        ecs_scheduler_run_wave(self, wave);
+        pending &= ~wave;
+    }
+
+    ecs_w_commands_sync(w);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ECS snapshots
+//
+// Layout: the header, the entity tables up to the high-water mark, then
+// for each list its dense pages, then each archetype's chunks. Pages and
+// chunks only store the used part of each column. Sparse arrays aren't
+// stored, they get rebuilt from the dense entities.
+///////////////////////////////////////////////////////////////////////////////
+
+#define ECS_SNAPSHOT_MAGIC 0x45435331
+
+typedef struct Ecs_Snapshot_Header {
+    uint32_t magic;
+    uint32_t first_free_entity;
+    uint32_t high_water;
+    uint32_t n_archetypes;
+    // Lists that were initialized
+    uint64_t lists[2];
+} Ecs_Snapshot_Header;
+
+typedef struct Ecs_Snapshot_List {
+    uint32_t count;
+    uint32_t component_size;
+    uint64_t page_size;
+    bool archetype;
+} Ecs_Snapshot_List;
+
+typedef struct Ecs_Snapshot_Archetype {
+    uint64_t mask[2];
+    uint32_t count;
+} Ecs_Snapshot_Archetype;
+
+// Everything stays 8-byte aligned
+static void* ecs_snapshot_push(Ecs_Snapshot *self, size_t size)
+{
+    size = (size + 7) & ~(size_t) 7;
+    if (self->size + size > self->capacity) {
+        size_t capacity = self->capacity ? self->capacity : 4096;
+        while (capacity < self->size + size) {
+            capacity *= 2;
+        }
+        self->data = realloc(self->data, capacity);
+        if (!self->data) {
+            FAIL_MESSAGE("Couldn't allocate %zu bytes for an ECS snapshot", capacity);
+        }
+        self->capacity = capacity;
+    }
+    void *result = (char *) self->data + self->size;
+    self->size += size;
+    return result;
+}
+
+static void ecs_snapshot_write(Ecs_Snapshot *self, const void *src, size_t size)
+{
+    memcpy(ecs_snapshot_push(self, size), src, size);
+}
+
+static const void* ecs_snapshot_read(const char **cursor, size_t size)
+{
+    const void *result = *cursor;
+    *cursor += (size + 7) & ~(size_t) 7;
+    return result;
+}
+
+// Columns of dense page rows [begin, begin+n), with the field columns of
+// struct-of-arrays lists after the entities
+static void ecs_snapshot_save_rows(Ecs_Snapshot *self, Component_List *cl, Idx_t begin, uint32_t n)
+{
+    ecs_snapshot_write(self, ecs_dense_at(cl, begin), (size_t) cl->component_size * n);
+    for (int f = 0; f < cl->n_fields; ++f) {
+        ecs_snapshot_write(self, ecs_dense_field_at(cl, begin, f), (size_t) cl->field_sizes[f] * n);
+    }
+}
+
+void ecs_w_snapshot_save(Ecs_World *w, Ecs_Snapshot *self)
+{
+    self->size = 0;
+
+    Ecs_Snapshot_Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = ECS_SNAPSHOT_MAGIC;
+    header.first_free_entity = w->first_free_entity;
+    header.high_water = w->entity_high_water;
+    header.n_archetypes = w->n_archetypes;
+    for (int id = 0; id < MAX_COMPONENT_LISTS; ++id) {
+        if (w->component_lists[id].initialized) {
+            header.lists[id / 64] |= 1ULL << (id % 64);
+        }
+    }
+    ecs_snapshot_write(self, &header, sizeof(header));
+
+    uint32_t hw = w->entity_high_water;
+    ecs_snapshot_write(self, w->entity_list, sizeof(Entity_t) * hw);
+    ecs_snapshot_write(self, w->entity_component_lists, sizeof(uint64_t) * 2 * hw);
+    if (w->n_archetypes) {
+        ecs_snapshot_write(self, w->entity_locations, sizeof(Ecs_Location) * hw);
+    }
+
+    for (int id = 0; id < MAX_COMPONENT_LISTS; ++id) {
+        Component_List *cl = &w->component_lists[id];
+        if (!cl->initialized) {
+            continue;
+        }
+
+        Ecs_Snapshot_List list;
+        memset(&list, 0, sizeof(list));
+        list.count = cl->count;
+        list.component_size = cl->component_size;
+        list.page_size = cl->page_size;
+        list.archetype = cl->archetype;
+        ecs_snapshot_write(self, &list, sizeof(list));
+
+        if (cl->archetype) {
+            continue;
+        }
+        for (Idx_t i = 0; i < cl->count; i += DENSE_PAGE_SIZE) {
+            ecs_snapshot_save_rows(self, cl, i, MIN((uint32_t) DENSE_PAGE_SIZE, cl->count - i));
+        }
+    }
+
+    for (uint32_t i = 0; i < w->n_archetypes; ++i) {
+        Ecs_Archetype *a = &w->archetypes[i];
+        Ecs_Snapshot_Archetype arch;
+        memset(&arch, 0, sizeof(arch));
+        arch.mask[0] = a->mask[0];
+        arch.mask[1] = a->mask[1];
+        arch.count = a->count;
+        ecs_snapshot_write(self, &arch, sizeof(arch));
+
+        // The empty archetype has no chunks
+        for (uint32_t row = 0; a->n_columns && row < a->count; row += a->rows_per_chunk) {
+            uint32_t n = MIN(a->rows_per_chunk, a->count - row);
+            for (int c = 0; c < a->n_columns; ++c) {
+                ecs_snapshot_write(self, ecs_arch_at(a, c, row), (size_t) a->sizes[c] * n);
+            }
+        }
+    }
+}
+
+// Gets the archetype to exactly enough chunks for count rows
+static void ecs_arch_resize(Ecs_Archetype *a, uint32_t count)
+{
+    a->count = count;
+    if (!a->n_columns) {
+        return;
+    }
+
+    uint32_t n_chunks = (count + a->rows_per_chunk - 1) / a->rows_per_chunk;
+    if (n_chunks > a->chunks_capacity) {
+        a->chunks_capacity = n_chunks;
+        a->chunks = (void **) realloc(a->chunks, sizeof(void *) * a->chunks_capacity);
+        if (!a->chunks) {
+            FAIL_MESSAGE("Couldn't allocate memory for archetype chunks");
+        }
+    }
+    while (a->n_chunks < n_chunks) {
+        a->chunks[a->n_chunks] = malloc(a->chunk_size);
+        if (!a->chunks[a->n_chunks]) {
+            FAIL_MESSAGE("Couldn't allocate an archetype chunk");
+        }
+        a->n_chunks++;
+    }
+    while (a->n_chunks > n_chunks) {
+        free(a->chunks[--a->n_chunks]);
+    }
+}
+
+void ecs_w_snapshot_restore(Ecs_World *w, const Ecs_Snapshot *self)
+{
+    const char *cursor = (const char *) self->data;
+    const Ecs_Snapshot_Header *header = (const Ecs_Snapshot_Header *) ecs_snapshot_read(&cursor, sizeof(Ecs_Snapshot_Header));
+    if (self->size < sizeof(Ecs_Snapshot_Header) || header->magic != ECS_SNAPSHOT_MAGIC) {
+        FAIL_MESSAGE("Couldn't restore the ECS, the snapshot is empty or broken");
+    }
+    for (int id = 0; id < MAX_COMPONENT_LISTS; ++id) {
+        bool saved = (header->lists[id / 64] >> (id % 64)) & 1;
+        if (saved != w->component_lists[id].initialized) {
+            FAIL_MESSAGE("Couldn't restore the ECS, the component list at index (%d) was set up differently", id);
+        }
+    }
+
+    // Entity tables. IDs that got used after the snapshot go back to unused.
+    uint32_t hw = header->high_water;
+    ecs_entities_commit(w, hw);
+    if (w->entity_high_water > hw) {
+        uint32_t extra = w->entity_high_water - hw;
+        memset(w->entity_component_lists + hw * 2, 0, sizeof(uint64_t) * 2 * extra);
+        memset(w->entity_locations + hw, 0, sizeof(Ecs_Location) * extra);
+    }
+    memcpy(w->entity_list, ecs_snapshot_read(&cursor, sizeof(Entity_t) * hw), sizeof(Entity_t) * hw);
+    memcpy(w->entity_component_lists, ecs_snapshot_read(&cursor, sizeof(uint64_t) * 2 * hw), sizeof(uint64_t) * 2 * hw);
+    if (header->n_archetypes) {
+        memcpy(w->entity_locations, ecs_snapshot_read(&cursor, sizeof(Ecs_Location) * hw), sizeof(Ecs_Location) * hw);
+    } else {
+        memset(w->entity_locations, 0, sizeof(Ecs_Location) * hw);
+    }
+    w->first_free_entity = header->first_free_entity;
+    w->entity_high_water = hw;
+
+    for (int id = 0; id < MAX_COMPONENT_LISTS; ++id) {
+        Component_List *cl = &w->component_lists[id];
+        if (!cl->initialized) {
+            continue;
+        }
+
+        const Ecs_Snapshot_List *list = (const Ecs_Snapshot_List *) ecs_snapshot_read(&cursor, sizeof(Ecs_Snapshot_List));
+        if (list->component_size != cl->component_size || list->page_size != cl->page_size ||
+            list->archetype != cl->archetype) {
+            FAIL_MESSAGE("Couldn't restore the ECS, the component list at index (%d) was set up differently", id);
+        }
+        cl->deleted_component = false;
+        if (cl->archetype) {
+            cl->count = list->count;
+            continue;
+        }
+
+        // Forget the current entities
+        for (Idx_t i = 0; i < cl->count; ++i) {
+            Entity_t e = *ecs_dense_at(cl, i);
+            if (e) {
+                ecs_sparse_set(cl, e >> ENTITY_ID_SHIFT, SPARSE_NONE);
+            }
+        }
+
+        // Same pages as if the components got added one by one
+        uint32_t n_pages = (list->count + DENSE_PAGE_SIZE - 1) / DENSE_PAGE_SIZE;
+        for (uint32_t page = 0; page < n_pages; ++page) {
+            if (!cl->dense[page]) {
+                ecs_dense_page_add(w, cl, page);
+            }
+        }
+        cl->count = list->count;
+        ecs_dense_shrink(w, cl);
+
+        for (Idx_t i = 0; i < cl->count; i += DENSE_PAGE_SIZE) {
+            uint32_t n = MIN((uint32_t) DENSE_PAGE_SIZE, cl->count - i);
+            size_t size = (size_t) cl->component_size * n;
+            memcpy(ecs_dense_at(cl, i), ecs_snapshot_read(&cursor, size), size);
+            for (int f = 0; f < cl->n_fields; ++f) {
+                size = (size_t) cl->field_sizes[f] * n;
+                memcpy(ecs_dense_field_at(cl, i, f), ecs_snapshot_read(&cursor, size), size);
+            }
+        }
+        if (cl->count < MAX_ENTITIES && cl->dense[cl->count / DENSE_PAGE_SIZE]) {
+            // The iterators stop at the first empty slot
+            *ecs_dense_at(cl, cl->count) = 0;
+        }
+
+        for (Idx_t i = 0; i < cl->count; ++i) {
+            Entity_t e = *ecs_dense_at(cl, i);
+            if (e) {
+                *ecs_sparse_slot(cl, e >> ENTITY_ID_SHIFT) = i;
+            }
+        }
+    }
+
+    // Archetypes only ever get added, so the saved ones keep their indices
+    for (uint32_t i = 0; i < header->n_archetypes; ++i) {
+        const Ecs_Snapshot_Archetype *arch = (const Ecs_Snapshot_Archetype *) ecs_snapshot_read(&cursor, sizeof(Ecs_Snapshot_Archetype));
+        if (ecs_arch_get(w, arch->mask) != i) {
+            FAIL_MESSAGE("Couldn't restore the ECS, the archetypes were made in another order");
+        }
+
+        Ecs_Archetype *a = &w->archetypes[i];
+        ecs_arch_resize(a, arch->count);
+        for (uint32_t row = 0; a->n_columns && row < a->count; row += a->rows_per_chunk) {
+            uint32_t n = MIN(a->rows_per_chunk, a->count - row);
+            for (int c = 0; c < a->n_columns; ++c) {
+                size_t size = (size_t) a->sizes[c] * n;
+                memcpy(ecs_arch_at(a, c, row), ecs_snapshot_read(&cursor, size), size);
+            }
+        }
+    }
+    for (uint32_t i = header->n_archetypes; i < w->n_archetypes; ++i) {
+        ecs_arch_resize(&w->archetypes[i], 0);
+    }
+}
+
+void ecs_snapshot_free(Ecs_Snapshot *self)
+{
+    free(self->data);
+    memset(self, 0, sizeof(*self));
+}
+
+void ecs_w_purge_cls(Ecs_World *w)
+{
+    uint64_t purged[2] = { 0, 0 };
+    for (int id = 0; id < MAX_COMPONENT_LISTS; ++id) {
+        Component_List *cl = &w->component_lists[id];
+        if (cl->initialized && cl->archetype && !cl->no_purge) {
+            purged[id / 64] |= 1ULL << (id % 64);
+        }
+    }
+    if (purged[0] || purged[1]) {
+        ecs_arch_purge(w, purged);
+    }
+
+    for (int id = 0; id < 128; ++id) {
+        Component_List *cl = &w->component_lists[id];
+        if (!cl->initialized || cl->no_purge) {
+            continue;
+        }
+
+        // We're purging everything
+
+        // Dense pages. Arena pages get freed along with their arena.
+        ecs_dense_trim(w, cl, 0);
+        cl->page_arena = NULL;
+
+        // Sparse entities, only the pages that got used
+        ecs_sparse_clear(cl);
+        if (cl->track_changes) {
+            ecs_changes_reset(cl);
+        }
+
+        cl->n_dense_pages = 0;
+        cl->count = 0;
+    }
+
+    // Components in lists that don't get purged keep their entities alive
+    uint64_t keep[2] = { 0, 0 };
+    for (int id = 0; id < MAX_COMPONENT_LISTS; ++id) {
+        Component_List *cl = &w->component_lists[id];
+        if (cl->initialized && cl->no_purge && cl->count) {
+            keep[id / 64] |= 1ULL << (id % 64);
+        }
+    }
+
+    // Rebuild the free list from the back, so the lowest IDs come out first.
+    // Only the IDs that were ever used need it.
+    w->first_free_entity = ENTITY_FREE_END;
+    for (unsigned int i = w->entity_high_water; i-- > 0;) {
+        uint64_t *components = &w->entity_component_lists[i*2];
+        components[0] &= keep[0];
+        components[1] &= keep[1];
+
+        unsigned int version = w->entity_list[i] & ENTITY_VERSION_MASK;
+        if (components[0] || components[1]) {
+            w->entity_list[i] = (ENTITY_ALIVE << ENTITY_ID_SHIFT) | version;
+            continue;
+        }
+
+        if (w->entity_list[i] >> ENTITY_ID_SHIFT == ENTITY_ALIVE) {
+            // It was alive, old handles to it shouldn't match anymore
+            version = (version == ENTITY_VERSION_MASK) ? 1 : version + 1;
+        }
+        w->entity_list[i] = (w->first_free_entity << ENTITY_ID_SHIFT) | version;
+        w->first_free_entity = i;
+    }
+}
+
+
+// Entity manipulation
+Entity_t ecs_w_new_entity(Ecs_World *w)
+{
+    uint32_t id = w->first_free_entity;
+    if (id == ENTITY_FREE_END) {
+        // Nothing to reuse, take a fresh ID
+        if (w->entity_high_water == ENTITY_FREE_END) {
+            FAIL_MESSAGE("Entity limit reached.");
+        }
+        id = w->entity_high_water++;
+        ecs_entities_commit(w, w->entity_high_water);
+        w->entity_list[id] = (ENTITY_FREE_END << ENTITY_ID_SHIFT) | 1;
+    }
+
+    Entity_t *entity = &w->entity_list[id];
+    Entity_t result = (id << ENTITY_ID_SHIFT) | (*entity & ENTITY_VERSION_MASK);
+
+    if (id == (*entity >> ENTITY_ID_SHIFT)) {
+        printf("ECS error\n");
+    }
+
+    w->first_free_entity = *entity >> ENTITY_ID_SHIFT;
+    *entity = (ENTITY_ALIVE << ENTITY_ID_SHIFT) | (*entity & ENTITY_VERSION_MASK);
+
+    return result;
+}
+
+void ecs_w_new_entities(Ecs_World *w, Entity_t *out, uint32_t n)
+{
+    uint32_t i = 0;
+    // Reused IDs first
+    for (; i < n && w->first_free_entity != ENTITY_FREE_END; ++i) {
+        uint32_t id = w->first_free_entity;
+        Entity_t *entity = &w->entity_list[id];
+        out[i] = (id << ENTITY_ID_SHIFT) | (*entity & ENTITY_VERSION_MASK);
+        w->first_free_entity = *entity >> ENTITY_ID_SHIFT;
+        *entity = (ENTITY_ALIVE << ENTITY_ID_SHIFT) | (*entity & ENTITY_VERSION_MASK);
+    }
+    if (i == n) {
+        return;
+    }
+
+    // Then a block of fresh ones
+    uint32_t fresh = n - i;
+    if (fresh > ENTITY_FREE_END - w->entity_high_water) {
+        FAIL_MESSAGE("Entity limit reached.");
+    }
+    uint32_t id = w->entity_high_water;
+    w->entity_high_water += fresh;
+    ecs_entities_commit(w, w->entity_high_water);
+    for (; i < n; ++i, ++id) {
+        w->entity_list[id] = (ENTITY_ALIVE << ENTITY_ID_SHIFT) | 1;
+        out[i] = (id << ENTITY_ID_SHIFT) | 1;
+    }
+}
+
+static void ecs_unreg_entity(Ecs_World *w, Entity_t entity)
+{
+    // No error checking here
+    Idx_t idx = entity >> ENTITY_ID_SHIFT;
+    Entity_t *en = &w->entity_list[idx];
+
+    // Delete entity from list
+    unsigned int version = entity & ENTITY_VERSION_MASK;
+    version = (version == ENTITY_VERSION_MASK) ? 1 : version + 1;
+    *en = (w->first_free_entity << ENTITY_ID_SHIFT) | version;
+    w->first_free_entity = idx;
+}
+
+
+void ecs_w_delete_entity(Ecs_World *w, Entity_t entity)
+{
+    Idx_t idx = entity >> ENTITY_ID_SHIFT;
+    if (idx >= w->entity_high_water) {
+        return;
+    }
+    Entity_t *e = &w->entity_list[idx];
+
+    if (*e >> ENTITY_ID_SHIFT != ENTITY_ALIVE) {
+        // Entity doesn't exist
+        return;
+    }
+
+    if ((*e & ENTITY_VERSION_MASK) != (entity & ENTITY_VERSION_MASK)) {
+        // Entity already has a new version
+        return;
+    }
+
+    // Archetype components go all at once
+    ecs_arch_detach(w, idx);
+
+    // Delete its components
+    uint64_t *components = &w->entity_component_lists[idx * 2];
+    if (!components[0] && !components[1]) {
+        ecs_unreg_entity(w, entity);
+        return;
+    }
+    for (int i = 0; i < 2; ++i) {
+        for (int j = 0; components[i] && j < 64; ++j) {
+            if (components[i] & (1ULL << j)) {
+                ecs_w_remove_component(w, i*64 + j, entity);
+            }
+        }
+    }
+}
+
+void ecs_w_delete_entities(Ecs_World *w, const Entity_t *entities, uint32_t n)
+{
+    // Free the IDs first, and collect the lists that need a pass
+    uint64_t lists[2] = { 0, 0 };
+    for (uint32_t i = 0; i < n; ++i) {
+        Entity_t entity = entities[i];
+        Idx_t idx = entity >> ENTITY_ID_SHIFT;
+        if (idx >= w->entity_high_water || w->entity_list[idx] != ((ENTITY_ALIVE << ENTITY_ID_SHIFT) | (entity & ENTITY_VERSION_MASK))) {
+            // Gone already, or a newer version
+            continue;
+        }
+
+        ecs_arch_detach(w, idx);
+        uint64_t *components = &w->entity_component_lists[idx * 2];
+        lists[0] |= components[0];
+        lists[1] |= components[1];
+        components[0] = components[1] = 0;
+        ecs_unreg_entity(w, entity);
+    }
+
+    // The dense arrays still hold the old handles, and only the deleted
+    // entities match them
+    for (int id = 0; id < MAX_COMPONENT_LISTS; ++id) {
+        Component_List *cl = &w->component_lists[id];
+        if (!(lists[id / 64] & (1ULL << id % 64)) || cl->archetype) {
+            continue;
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            ecs_dense_remove(w, cl, entities[i]);
+        }
+    }
+}
+
+// Worlds get slots in each thread's table of command buffers. Worlds can be
+// made and destroyed from any thread, so the bits get flipped with a CAS.
+STATIC_ASSERT(ECS_MAX_WORLDS % 32 == 0, ecs_max_worlds_is_whole_words);
+static uint32_t _ecs_world_slots[ECS_MAX_WORLDS / 32];
+static uint32_t _ecs_world_serial;
+
+static uint32_t ecs_world_take_slot(void)
+{
+    for (uint32_t word = 0; word < ECS_MAX_WORLDS / 32; ++word) {
+        uint32_t used = ATOMIC_LOAD_32(&_ecs_world_slots[word]);
+        while (used != ~0u) {
+            uint32_t bit = 0;
+            while (used & (1u << bit)) {
+                bit++;
+            }
+            if (ATOMIC_CAS_32(&_ecs_world_slots[word], used, used | (1u << bit))) {
+                return word * 32 + bit;
+            }
+            // Somebody else got in first, try again with what's there now
+            used = ATOMIC_LOAD_32(&_ecs_world_slots[word]);
+        }
+    }
+    FAIL_MESSAGE("Couldn't make a new ECS world, there are already %d", ECS_MAX_WORLDS);
+    return 0;
+}
+
+static void ecs_world_free_slot(uint32_t slot)
+{
+    uint32_t *word = &_ecs_world_slots[slot / 32];
+    uint32_t used = ATOMIC_LOAD_32(word);
+    while (!ATOMIC_CAS_32(word, used, used & ~(1u << (slot % 32)))) {
+        used = ATOMIC_LOAD_32(word);
+    }
+}
+
+static void ecs_w_init(Ecs_World *w)
+{
+    if (!w->entity_list) {
+        w->entity_list = (Entity_t *) os_memory_reserve(sizeof(Entity_t) * MAX_ENTITIES);
+        w->entity_component_lists = (uint64_t *) os_memory_reserve(sizeof(uint64_t) * 2 * MAX_ENTITIES);
+        w->entity_locations = (Ecs_Location *) os_memory_reserve(sizeof(Ecs_Location) * MAX_ENTITIES);
+        if (!w->entity_list || !w->entity_component_lists || !w->entity_locations) {
+            FAIL_MESSAGE("Couldn't reserve memory for the entity tables");
+        }
+    } else {
+        memset(w->entity_list, 0, sizeof(Entity_t) * w->entity_high_water);
+        memset(w->entity_component_lists, 0, sizeof(uint64_t) * 2 * w->entity_high_water);
+        memset(w->entity_locations, 0, sizeof(Ecs_Location) * w->entity_high_water);
+    }
+    ecs_arch_deinit(w);
+
+    w->first_free_entity = ENTITY_FREE_END;
+    w->entity_high_water = 0;
+
+    if (!w->initialized) {
+        w->slot = ecs_world_take_slot();
+        w->serial = ATOMIC_ADD_32(&_ecs_world_serial, 1) + 1;
+        w->frame = 1;
+        os_mutex_init(&w->thread_commands_mutex);
+        w->initialized = true;
+    }
+}
+
+static void ecs_w_deinit(Ecs_World *w)
+{
+    if (!w->entity_list) {
+        return;
+    }
+    os_memory_release(w->entity_list, sizeof(Entity_t) * MAX_ENTITIES);
+    os_memory_release(w->entity_component_lists, sizeof(uint64_t) * 2 * MAX_ENTITIES);
+    os_memory_release(w->entity_locations, sizeof(Ecs_Location) * MAX_ENTITIES);
+    ecs_arch_deinit(w);
+
+    w->entity_list = NULL;
+    w->entity_component_lists = NULL;
+    w->entity_locations = NULL;
+    w->first_free_entity = ENTITY_FREE_END;
+    w->entity_high_water = 0;
+    w->entity_committed = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ECS worlds
+//
+// The functions without a world in their arguments work on the default
+// world, which is what ecs_init() sets up.
+///////////////////////////////////////////////////////////////////////////////
+
+Ecs_World* ecs_default_world(void)
+{
+    return &_ecs_default_world;
+}
+
+Ecs_World* ecs_world_create(void)
+{
+    Ecs_World *w = (Ecs_World *) calloc(1, sizeof(Ecs_World));
+    if (!w) {
+        FAIL_MESSAGE("Couldn't allocate an ECS world");
+    }
+    ecs_w_init(w);
+    return w;
+}
+
+void ecs_world_destroy(Ecs_World *w)
+{
+    for (int id = 0; id < MAX_COMPONENT_LISTS; ++id) {
+        if (w->component_lists[id].initialized) {
+            ecs_w_cl_deinit(w, id);
+        }
+    }
+    for (uint32_t i = 0; i < w->n_thread_commands; ++i) {
+        ecs_commands_deinit(w->thread_commands[i]);
+        free(w->thread_commands[i]);
+    }
+    free(w->thread_commands);
+    free(w->command_refs);
+    free(w->sort_entries);
+    free(w->sort_slot);
+    if (w->page_arena) {
+        arena_release(w->page_arena);
+        w->page_arena = NULL;
+    }
+    w->n_page_pools = 0;
+    if (w->initialized) {
+        os_mutex_deinit(&w->thread_commands_mutex);
+        ecs_world_free_slot(w->slot);
+    }
+    ecs_w_deinit(w);
+
+    if (w == &_ecs_default_world) {
+        memset(w, 0, sizeof(*w));
+    } else {
+        free(w);
+    }
+}
+
+void ecs_cl_init_sz(int id, unsigned int element_size)
+{
+    ecs_w_cl_init_sz(&_ecs_default_world, id, element_size);
+}
+
+void ecs_cl_init_soa(int id, const unsigned int *field_sizes, int n_fields)
+{
+    ecs_w_cl_init_soa(&_ecs_default_world, id, field_sizes, n_fields);
+}
+
+void ecs_cl_deinit(int id)
+{
+    ecs_w_cl_deinit(&_ecs_default_world, id);
+}
+
+uint32_t ecs_frame(void)
+{
+    return ecs_w_frame(&_ecs_default_world);
+}
+
+uint32_t ecs_advance_frame(void)
+{
+    return ecs_w_advance_frame(&_ecs_default_world);
+}
+
+void ecs_cl_track_changes(int id, bool track)
+{
+    ecs_w_cl_track_changes(&_ecs_default_world, id, track);
+}
+
+void ecs_mark_changed(int id, Entity_t entity)
+{
+    ecs_w_mark_changed(&_ecs_default_world, id, entity);
+}
+
+void* ecs_write_component(int id, Entity_t entity)
+{
+    return ecs_w_write_component(&_ecs_default_world, id, entity);
+}
+
+void ecs_cl_trim_changes(int id, uint32_t before_frame)
+{
+    ecs_w_cl_trim_changes(&_ecs_default_world, id, before_frame);
+}
+
+void ecs_changes_begin(Ecs_Change_Iter *it, int id, uint32_t since_frame)
+{
+    ecs_w_changes_begin(&_ecs_default_world, it, id, since_frame);
+}
+
+void* ecs_get_component_nullable(int id, Entity_t entity)
+{
+    return ecs_w_get_component_nullable(&_ecs_default_world, id, entity);
+}
+
+void* ecs_get_component(int id, Entity_t entity)
+{
+    return ecs_w_get_component(&_ecs_default_world, id, entity);
+}
+
+void* ecs_new_component(int id, Entity_t entity)
+{
+    return ecs_w_new_component(&_ecs_default_world, id, entity);
+}
+
+Idx_t ecs_new_components(int id, const Entity_t *entities, uint32_t n, const void *data)
+{
+    return ecs_w_new_components(&_ecs_default_world, id, entities, n, data);
+}
+
+void ecs_remove_component(int id, Entity_t entity)
+{
+    ecs_w_remove_component(&_ecs_default_world, id, entity);
+}
+
+void ecs_cl_ordered_clean(int id)
+{
+    ecs_w_cl_ordered_clean(&_ecs_default_world, id);
+}
+
+uint32_t ecs_cl_sort_by_entity(int id)
+{
+    return ecs_w_cl_sort_by_entity(&_ecs_default_world, id);
+}
+
+uint32_t ecs_cl_sort_by_key(int id, Ecs_Sort_Key key, void *arg)
+{
+    return ecs_w_cl_sort_by_key(&_ecs_default_world, id, key, arg);
+}
+
+uint32_t ecs_cl_sort_like(int id, int like_id)
+{
+    return ecs_w_cl_sort_like(&_ecs_default_world, id, like_id);
+}
+
+Idx_t ecs_cl_count(int id)
+{
+    return ecs_w_cl_count(&_ecs_default_world, id);
+}
+
+void* ecs_cl_at(int id, Idx_t index)
+{
+    return ecs_w_cl_at(&_ecs_default_world, id, index);
+}
+
+void* ecs_cl_begin(int id)
+{
+    return ecs_w_cl_begin(&_ecs_default_world, id);
+}
+
+void* ecs_cl_next(int id, void *iter)
+{
+    return ecs_w_cl_next(&_ecs_default_world, id, iter);
+}
+
+uint32_t ecs_soa_page_count(int id)
+{
+    return ecs_w_soa_page_count(&_ecs_default_world, id);
+}
+
+void* ecs_soa_column(int id, uint32_t page, int field, uint32_t *count)
+{
+    return ecs_w_soa_column(&_ecs_default_world, id, page, field, count);
+}
+
+void* ecs_soa_field(int id, Entity_t entity, int field)
+{
+    return ecs_w_soa_field(&_ecs_default_world, id, entity, field);
+}
+
+void ecs_query_init(Ecs_Query *self, const int *ids, int n_ids)
+{
+    ecs_w_query_init(&_ecs_default_world, self, ids, n_ids);
+}
+
+void ecs_cl_allow_purge(int id, bool allow)
+{
+    ecs_w_cl_allow_purge(&_ecs_default_world, id, allow);
+}
+
+void ecs_cl_keep_ordering(int id, bool keep)
+{
+    ecs_w_cl_keep_ordering(&_ecs_default_world, id, keep);
+}
+
+void ecs_cl_use_archetypes(int id, bool use)
+{
+    ecs_w_cl_use_archetypes(&_ecs_default_world, id, use);
+}
+
+void ecs_commands_init(Ecs_Command_Buffer *self)
+{
+    ecs_w_commands_init(&_ecs_default_world, self);
+}
+
+Ecs_Command_Buffer* ecs_thread_commands(void)
+{
+    return ecs_w_thread_commands(&_ecs_default_world);
+}
+
+void ecs_commands_sync(void)
+{
+    ecs_w_commands_sync(&_ecs_default_world);
+}
+
+void ecs_scheduler_init(Ecs_Scheduler *self, Job_System *jobs)
+{
+    ecs_w_scheduler_init(&_ecs_default_world, self, jobs);
+}
+
+void ecs_snapshot_save(Ecs_Snapshot *self)
+{
+    ecs_w_snapshot_save(&_ecs_default_world, self);
+}
+
+void ecs_snapshot_restore(const Ecs_Snapshot *self)
+{
+    ecs_w_snapshot_restore(&_ecs_default_world, self);
+}
+
+void ecs_purge_cls(void)
+{
+    ecs_w_purge_cls(&_ecs_default_world);
+}
+
+Entity_t ecs_new_entity(void)
+{
+    return ecs_w_new_entity(&_ecs_default_world);
+}
+
+void ecs_new_entities(Entity_t *out, uint32_t n)
+{
+    ecs_w_new_entities(&_ecs_default_world, out, n);
+}
+
+void ecs_delete_entity(Entity_t entity)
+{
+    ecs_w_delete_entity(&_ecs_default_world, entity);
+}
+
+void ecs_delete_entities(const Entity_t *entities, uint32_t n)
+{
+    ecs_w_delete_entities(&_ecs_default_world, entities, n);
+}
+
+void ecs_init(void)
+{
+    ecs_w_init(&_ecs_default_world);
+}
+
+void ecs_deinit(void)
+{
+    ecs_w_deinit(&_ecs_default_world);
+}
@@ -22,6 +22,9 @@ extern "C" {
 typedef uint32_t Entity_t;
 typedef uint32_t Idx_t;
 
+// An independent set of entities and component lists
+typedef struct Ecs_World Ecs_World;
+
 // Multiples of 2
 #define EVENT_START_SCENE 4
 #define EVENT_END_SCENE 8
@@ -33,6 +36,12 @@ typedef uint32_t Idx_t;
 #define ENTITY_ID_MASK 0xFFFFF000
 
 #define MAX_COMPONENT_LISTS 128
+// Worlds that can be around at the same time
+#define ECS_MAX_WORLDS 64
+// Struct-of-arrays component lists
+#define ECS_SOA_MAX_FIELDS 16
+// Column index of the entities themselves
+#define ECS_SOA_ENTITIES (-1)
 
 
 typedef struct Event_t {
@@ -50,19 +59,204 @@ typedef struct Event_Callback {
     int type_mask;
 } Event_Callback;
 
+// A run of callbacks with the same type_mask
+typedef struct Event_Callback_Group {
+    int type_mask;
+    uint32_t start;
+    uint32_t count;
+} Event_Callback_Group;
+
+// A zeroed struct is an empty list. Use events_subscribe() and
+// events_unsubscribe() to manage it, rather than filling data by hand.
 typedef struct Event_Callbacks {
     Event_Callback *data;
     uint32_t count;
     uint32_t capacity;
+
+    // Storage comes from this arena. When it's NULL, the list makes
+    // (and owns) its own arena on the first subscribe.
+    struct Arena *arena;
+    bool owns_arena;
+
+    // Callbacks are kept grouped by type_mask, so dispatching
+    // can skip whole groups
+    Event_Callback_Group *groups;
+    uint32_t n_groups;
+    uint32_t groups_capacity;
+
+    // Changes made while dispatching get applied once it's over
+    uint32_t dispatch_depth;
+    uint32_t n_removed;
+    Event_Callback *pending;
+    uint32_t n_pending;
+    uint32_t pending_capacity;
 } Event_Callbacks;
 
+// One subscriber list per bit of Event_t::type
+#define EVENT_TYPE_COUNT 32
+#define EVENT_QUEUE_DEFAULT_SIZE 256
+
+// How queued events of one type get merged before they're dispatched
+typedef enum Event_Coalesce {
+    EVENT_COALESCE_NONE = 0,
+    // Only the latest event survives, in the place of the first one
+    // (e.g. mouse position, stick state)
+    EVENT_COALESCE_LATEST,
+    // param1 and param2 get summed up (e.g. mouse deltas)
+    EVENT_COALESCE_ACCUMULATE,
+    // Dropped if the same event was already posted in this frame or the
+    // last one (e.g. collision stay)
+    EVENT_COALESCE_DROP_REPEATS,
+
+    // Flag: events with a different param1 are kept apart
+    // (e.g. one latest event per axis, or per body)
+    EVENT_COALESCE_BY_PARAM1 = 1 << 4,
+} Event_Coalesce;
+
+// Return false to drop the event before it's queued
+typedef bool (*Event_Filter)(void *arg, const Event_t *ev);
+
+typedef struct Event_Coalesce_Entry {
+    // Key
+    unsigned int type;
+    int param1;
+
+    Event_t last;
+    uint32_t generation; // The flush count at the time it got posted
+    uint32_t index; // Which posted event it is
+    bool used;
+} Event_Coalesce_Entry;
+
+// Events get posted during the frame, and are dispatched together
+// at the flush point.
+typedef struct Event_Queue {
+    // Ring buffer, the capacity is a power of 2
+    Event_t *events;
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;
+
+    // Dispatching an event only walks the lists of its type bits
+    Event_Callbacks by_type[EVENT_TYPE_COUNT];
+    // Shared by the lists above
+    struct Arena *arena;
+
+    // Coalescing and filtering, configured for each type bit
+    uint8_t coalesce[EVENT_TYPE_COUNT];
+    Event_Filter filters[EVENT_TYPE_COUNT];
+    void *filter_args[EVENT_TYPE_COUNT];
+
+    // Finds the queued event that a new one merges into
+    Event_Coalesce_Entry *table;
+    uint32_t table_capacity;
+    // Slots in use, dead entries included, since they're still on probe
+    // paths until the table gets rebuilt
+    uint32_t table_inserts;
+
+    uint32_t generation;
+    uint32_t posted;
+} Event_Queue;
+
+#define EVENT_MPSC_BATCH_SIZE 32
+
+typedef struct Event_Mpsc_Slot {
+    // Tells whether the slot is free or holds an event, for the current lap
+    uint32_t sequence;
+    Event_t ev;
+} Event_Mpsc_Slot;
+
+// Bounded and lock-free. Any thread can post, one thread drains.
+typedef struct Event_Mpsc_Queue {
+    Event_Mpsc_Slot *slots;
+    uint32_t capacity; // Power of 2
+    uint32_t mask;
+
+    // Producers and the consumer get their own cache lines
+    char pad0_[64];
+    uint32_t tail; // Where producers reserve slots
+    char pad1_[64];
+    uint32_t head; // Only used by the consumer
+    char pad2_[64];
+} Event_Mpsc_Queue;
+
+// Local to a producer thread, so it only touches the shared queue
+// once per batch of events
+typedef struct Event_Batch {
+    Event_Mpsc_Queue *queue;
+    uint32_t count;
+    Event_t events[EVENT_MPSC_BATCH_SIZE];
+} Event_Batch;
+
+
+#define TIME_DEFAULT_CAPACITY 300
+
+// Pass this as the count of a periodic task to repeat it until it's removed
+#define TIME_REPEAT_FOREVER ((unsigned int) -1)
+
+// What a periodic task does when the polling falls behind its interval
+typedef enum Time_Catch_Up {
+    // Drop the missed runs, the next run is one interval from now
+    TIME_CATCH_UP_SKIP = 0,
+    // Run once per poll, until it's back on schedule
+    TIME_CATCH_UP_ONE,
+    // Run every missed interval in the same poll
+    TIME_CATCH_UP_ALL,
+} Time_Catch_Up;
+
+// Payloads up to this size get copied into the task slot itself.
+// Bigger ones take power-of-two blocks from the timing system's arena,
+// from 64 bytes up. Freed blocks go on a list per size, to be reused.
+#define TIME_TASK_PAYLOAD_SIZE 32
+#define TIME_PAYLOAD_BLOCK_SHIFT 6
+#define TIME_PAYLOAD_CLASSES 26
+
+typedef enum Time_Task_Flags {
+    TIME_TASK_FLAG_NONE = 0,
+    // Never runs on a worker thread. Use it for tasks that touch the ECS,
+    // the scene, the timing system or anything else that isn't thread safe.
+    TIME_TASK_MAIN_THREAD = 1 << 0,
+} Time_Task_Flags;
 
 typedef void (*Task_Consumer)();
+// Gets the user pointer, or a pointer to the task's copy of the payload
+typedef void (*Task_Consumer_Arg)(void *arg);
+
 typedef struct Timed_Task {
-    Task_Consumer cons;
-    float snapshot; // The snapshot in time at which the action happened
+    union {
+        Task_Consumer cons;
+        Task_Consumer_Arg cons_arg;
+    };
+    void *arg;
+    bool has_arg;
+
+    float snapshot; // The snapshot in time at which the action happens
     float delay;
+    // When a periodic task is due without its jitter, so the jitter
+    // doesn't pile up from one run to the next
+    float scheduled;
+
+    // Periodic tasks reschedule themselves in the same slot after firing
+    float interval;
+    float jitter;
+    unsigned int repeats_left;
+    Time_Catch_Up catch_up;
+    bool periodic;
+
+    uint32_t flags;
+    // How many times it runs in the current batch
+    unsigned int due_runs;
+
+    bool in_use;
     struct Timed_Task *next;
+
+    union {
+        unsigned char bytes[TIME_TASK_PAYLOAD_SIZE];
+        uint64_t align_;
+    } payload;
+    // A block from the timing system for payloads that don't fit,
+    // reused when a new one does
+    void *big_payload;
+    size_t big_payload_capacity;
 } Timed_Task;
 
 
@@ -73,24 +267,255 @@ typedef struct Timing_System {
 
     size_t count;
     size_t capacity;
+
+    // One past the highest slot that was ever handed out,
+    // so polling doesn't walk the whole pool
+    size_t high_water;
+
+    // Due tasks get collected into a batch for the workers
+    struct Job_System *jobs;
+    Timed_Task **batch;
+    size_t parallel_min;
+
+    // Where the big payloads come from. Blocks are never given back to
+    // the arena, only to the free lists.
+    struct Arena *payload_arena;
+    void *payload_free[TIME_PAYLOAD_CLASSES];
 } Timing_System;
 
 
+// A scene's name, hashed (FNV-1a). 0 is never a valid id.
+typedef uint32_t Scene_Id;
+#define SCENE_ID_NONE 0
+#define SCENE_ID_OFFSET 2166136261u
+#define SCENE_ID_PRIME 16777619u
+
+#define SCENE_REGISTRY_DEFAULT_CAPACITY 64
+
+// Builds a scene's data, on a background thread. Everything it allocates
+// should come from the arena, which the scene owns from then on.
+// Returns the scene data.
+typedef void* (*Scene_Load_Fn)(void *arg, struct Arena *arena, const char *name);
+
+typedef struct Scene {
+    Scene_Id id;
+    const char *name;
+    // Everything the scene owns. It's cleared as a whole when the scene
+    // ends, and reused by a later scene.
+    struct Arena *arena;
+    void *data;
+    // Where the loaded data ends in the arena
+    uint64_t loaded_position;
+} Scene;
+
+typedef struct Scene_Desc {
+    // Optional, runs on a background thread like in scene_switch_async()
+    Scene_Load_Fn load;
+    // Run on the main thread, right before EVENT_START_SCENE and
+    // EVENT_END_SCENE go out
+    void (*on_start)(void *arg, void *data);
+    void (*on_end)(void *arg, void *data);
+    void *arg;
+
+    // Keep what load() built after the scene ends, so switching back to it
+    // skips loading. Whatever the scene allocated while running still
+    // gets freed.
+    bool retain_warm;
+} Scene_Desc;
+
+typedef struct Scene_Entry {
+    Scene_Id id;
+    // Lives in the persistent arena
+    const char *name;
+    Scene_Desc desc;
+
+    // Set while the scene is warm and not running
+    struct Arena *warm_arena;
+    void *warm_data;
+    uint64_t warm_position;
+} Scene_Entry;
+
+typedef enum Scene_Arena_Kind {
+    // Lives until scene_system_deinit()
+    SCENE_ARENA_PERSISTENT = 0,
+    // Lives as long as the current scene
+    SCENE_ARENA_SCENE,
+    // Cleared at every scene_update()
+    SCENE_ARENA_FRAME,
+} Scene_Arena_Kind;
+
+#define ECS_QUERY_MAX_COMPONENTS 8
+
+// Walks the entities that have all of the query's components.
+// The smallest list drives the walk, the others only get looked up.
+typedef struct Ecs_Query {
+    Ecs_World *world;
+    int ids[ECS_QUERY_MAX_COMPONENTS];
+    int n_ids;
+    uint64_t mask[2];
+
+    // Index of the driving list, -1 when walking archetypes
+    int driver;
+    bool by_archetype;
+    uint32_t archetype;
+    Idx_t index;
+
+    // The current match. Components are in the same order as the ids.
+    Entity_t entity;
+    void *components[ECS_QUERY_MAX_COMPONENTS];
+} Ecs_Query;
+
+#define ECS_MAX_SYSTEMS 64
+
+// Gets a piece [begin, end) of the dense array of the list it's split by,
+// or [0, 1) if it isn't split
+typedef void (*Ecs_System_Fn)(void *arg, uint32_t begin, uint32_t end);
+
+typedef struct Ecs_System_Desc {
+    Ecs_System_Fn fn;
+    void *arg;
+
+    // Component list IDs the system reads and writes. Systems that don't
+    // write anything the other reads or writes can run at the same time.
+    const int *reads;
+    int n_reads;
+    const int *writes;
+    int n_writes;
+
+    // A list to split into dense page sized jobs, -1 for a single job
+    int split_by;
+    // Runs on the thread that calls ecs_scheduler_run()
+    bool main_thread;
+} Ecs_System_Desc;
+
+typedef struct Ecs_System {
+    Ecs_System_Fn fn;
+    void *arg;
+    uint64_t reads[2];
+    uint64_t writes[2];
+    int split_by;
+    bool main_thread;
+    bool enabled;
+} Ecs_System;
+
+typedef struct Ecs_Scheduler {
+    // In the order they got added, which is the order they'd run in
+    // on a single thread
+    Ecs_System systems[ECS_MAX_SYSTEMS];
+    int n_systems;
+
+    Ecs_World *world;
+    struct Job_System *jobs;
+    struct Job_Range *tasks;
+    uint32_t tasks_capacity;
+} Ecs_Scheduler;
+
+
+// Walks the entities whose component changed since some frame, once each
+typedef struct Ecs_Change_Iter {
+    Ecs_World *world;
+    int id;
+    uint32_t pos;
+
+    Entity_t entity;
+    void *component;
+} Ecs_Change_Iter;
+
+
+#define ECS_COMMAND_BLOCK_SIZE 256
+
+typedef enum Ecs_Command_Kind {
+    ECS_COMMAND_CREATE = 0,
+    ECS_COMMAND_ADD,
+    ECS_COMMAND_REMOVE,
+    ECS_COMMAND_DELETE,
+} Ecs_Command_Kind;
+
+typedef struct Ecs_Command {
+    uint8_t kind;
+    uint8_t id;
+    Entity_t entity;
+    // The component to copy in for ECS_COMMAND_ADD, NULL for zeroes
+    void *data;
+} Ecs_Command;
+
+typedef struct Ecs_Command_Block {
+    Ecs_Command commands[ECS_COMMAND_BLOCK_SIZE];
+    uint32_t count;
+    struct Ecs_Command_Block *next;
+} Ecs_Command_Block;
+
+// Records structural changes to apply later, at a sync point.
+// One buffer should only be used by one thread at a time.
+typedef struct Ecs_Command_Buffer {
+    // The world the commands get applied to
+    Ecs_World *world;
+    // Commands and component data, cleared after applying
+    struct Arena *arena;
+    Ecs_Command_Block *first;
+    Ecs_Command_Block *last;
+    uint32_t count;
+
+    // Entities from ecs_cmd_create() get real IDs when applied
+    uint32_t n_created;
+} Ecs_Command_Buffer;
+
+// The whole ECS state in one buffer. Keep one around and save into it
+// again, the memory gets reused.
+typedef struct Ecs_Snapshot {
+    void *data;
+    size_t size;
+    size_t capacity;
+} Ecs_Snapshot;
+
+
 // Global variables woo
 
 extern const char *g_scene_name;
+extern Scene_Id g_scene_id;
+extern void *g_scene_data;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Timing system
 ///////////////////////////////////////////////////////////////////////////////
 
 void time_init(Timing_System *self);
+void time_init_sz(Timing_System *self, size_t capacity);
 void time_deinit(Timing_System *self);
 
+// Runs due tasks on the job system's workers, once at least min_batch of
+// them are due in the same poll. Tasks flagged TIME_TASK_MAIN_THREAD still
+// run on the polling thread, after the batch. NULL goes back to serial.
+// Worker tasks must not schedule or remove tasks themselves.
+void time_set_job_system(Timing_System *self, struct Job_System *jobs, size_t min_batch);
+
 
 Timed_Task* time_schedule(Timing_System *self, float delay, Task_Consumer cons);
-void time_repeat_delayed(Timing_System *self,
+Timed_Task* time_schedule_arg(Timing_System *self, float delay, Task_Consumer_Arg cons, void *arg);
+// Copies the payload, the callback gets a pointer to the copy
+Timed_Task* time_schedule_payload(Timing_System *self, float delay,
+    Task_Consumer_Arg cons, const void *payload, size_t size);
+
+// A single task that fires every interval, count times
+// (or TIME_REPEAT_FOREVER). It only takes one slot from the pool.
+// An interval of 0 fires once every poll. NULL for a negative interval.
+Timed_Task* time_schedule_periodic(Timing_System *self,
     float initial_delay, float interval, unsigned int count, Task_Consumer cons);
+Timed_Task* time_repeat_delayed(Timing_System *self,
+    float initial_delay, float interval, unsigned int count, Task_Consumer cons);
+
+// Periodic task settings
+// Each run gets delayed by a random amount in [0, jitter]
+void time_task_set_jitter(Timed_Task *task, float jitter);
+void time_task_set_catch_up(Timed_Task *task, Time_Catch_Up policy);
+// Time_Task_Flags
+void time_task_set_flags(Timed_Task *task, uint32_t flags);
+
+// Swap the callback of an existing task (e.g. a periodic one)
+void time_task_set_arg(Timed_Task *task, Task_Consumer_Arg cons, void *arg);
+// Returns the payload copy. It lives as long as the task does.
+void* time_task_set_payload(Timing_System *self, Timed_Task *task,
+    Task_Consumer_Arg cons, const void *payload, size_t size);
 
 void time_remove(Timing_System *self, Timed_Task *task);
 
@@ -109,6 +534,60 @@ float time_time(void);
 void events_notify_update(Event_Callbacks *subscribers, Event_t *ev);
 void events_notify_input(Event_Callbacks *subscribers, Event_t *ev);
 
+// Subscriber registry
+// arena can be NULL, then the list allocates its own one
+void events_callbacks_init(Event_Callbacks *self, struct Arena *arena);
+void events_callbacks_deinit(Event_Callbacks *self);
+
+// Both are safe to call from inside a callback of the same list.
+// The change then takes effect after the dispatch.
+void events_subscribe(Event_Callbacks *self, Event_Callback callback);
+// Matches by function and arg. Returns false if there was no such callback.
+bool events_unsubscribe(Event_Callbacks *self, Event_Callback callback);
+
+// Event queue
+void events_queue_init(Event_Queue *self, uint32_t capacity);
+void events_queue_deinit(Event_Queue *self);
+
+// The input callback gets every queued event whose type is in its type_mask
+void events_queue_subscribe(Event_Queue *self, Event_Callback callback);
+void events_queue_unsubscribe(Event_Queue *self, Event_Callback callback);
+
+// type is a single bit. The policy is an Event_Coalesce,
+// optionally with EVENT_COALESCE_BY_PARAM1.
+void events_queue_set_coalesce(Event_Queue *self, unsigned int type, uint32_t policy);
+void events_queue_set_filter(Event_Queue *self, unsigned int type, Event_Filter filter, void *arg);
+
+// Copies the event into the queue, unless it gets filtered out or merged
+// into one that's already queued. The queue grows if it's full.
+// The lowest bit of the type decides which policy applies.
+void events_post(Event_Queue *self, const Event_t *ev);
+// Dispatches every event that was queued before the call, in order.
+// Call it once per frame. Events posted by the callbacks wait for
+// the next flush.
+void events_flush(Event_Queue *self);
+
+// Multi-producer, single-consumer event queue
+void events_mpsc_init(Event_Mpsc_Queue *self, uint32_t capacity);
+void events_mpsc_deinit(Event_Mpsc_Queue *self);
+
+// These never block. They return false if there isn't enough room,
+// and nothing gets posted in that case.
+bool events_mpsc_post(Event_Mpsc_Queue *self, const Event_t *ev);
+bool events_mpsc_post_many(Event_Mpsc_Queue *self, const Event_t *evs, uint32_t count);
+
+// Consumer side. Passes up to max events (0 for all of them)
+// to events_notify_input(), returns how many got drained.
+uint32_t events_mpsc_drain(Event_Mpsc_Queue *self, Event_Callbacks *subscribers, uint32_t max);
+
+// Producer-side batching
+void events_batch_init(Event_Batch *self, Event_Mpsc_Queue *queue);
+// Posts the batch when it fills up. Returns false if the event couldn't be
+// added, because the batch is full and the queue has no room for it.
+bool events_batch_add(Event_Batch *self, const Event_t *ev);
+// On failure the events stay in the batch, so it can be retried
+bool events_batch_flush(Event_Batch *self);
+
 
 // Called whenever a scene starts
 void events_start_scene(void);
@@ -120,7 +599,37 @@ void events_end_scene(void);
 // Scene system
 ///////////////////////////////////////////////////////////////////////////////
 
+Scene_Id scene_id(const char *name);
+
+// Registering a name twice replaces its callbacks
+Scene_Id scene_register(const char *name, const Scene_Desc *desc);
+// NULL if the id isn't registered
+Scene_Entry* scene_lookup(Scene_Id id);
+// Frees a warm scene's data. Does nothing to a running scene.
+void scene_evict(Scene_Id id);
+
+// Switching to a registered name is the same as scene_switch_id()
 void scene_switch(const char *to);
+// Returns false if the id isn't registered
+bool scene_switch_id(Scene_Id id);
+// Loads the next scene on a background thread, into its own arena.
+// It gets swapped in by the first scene_update() after the load is done.
+// Starting another switch while loading throws that load away.
+// A registered scene that's still warm gets switched to without loading.
+void scene_switch_async(const char *to, Scene_Load_Fn load, void *arg);
+bool scene_is_loading(void);
+
+// The deferred switch point. Call it once per frame, from the main thread.
+// At a switch, the old scene's arena gets cleared, and so do the ECS
+// component lists that allow purging.
+void scene_update(void);
+
+// NULL for SCENE_ARENA_SCENE if no scene was started yet
+struct Arena* scene_arena(Scene_Arena_Kind kind);
+void scene_system_deinit(void);
+
+// Input callbacks that get EVENT_END_SCENE and EVENT_START_SCENE
+Event_Callbacks* scene_handlers(void);
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -129,11 +638,18 @@ void scene_switch(const char *to);
 
 void ecs_cl_init_sz(int id, unsigned int element_size);
 #define ecs_cl_init(id, T) (ecs_cl_init_sz((id), sizeof(T)))
+// Struct-of-arrays: each field gets its own 16-byte aligned column in the
+// dense pages, so a loop over one field only touches that field's memory.
+// The components handed out by the other functions are just the entity
+// IDs, the fields go through ecs_soa_field() and ecs_soa_column().
+void ecs_cl_init_soa(int id, const unsigned int *field_sizes, int n_fields);
 
 void ecs_cl_deinit(int id);
 void ecs_purge_cls(void);
 
+// The entity tables only take memory for the IDs that got used
 void ecs_init(void);
+void ecs_deinit(void);
 
 void* ecs_get_component(int id, Entity_t entity);
 // Returns NULL if there's no entity
@@ -141,6 +657,12 @@ void* ecs_get_component_nullable(int id, Entity_t entity);
 
 void* ecs_new_component(int id, Entity_t entity);
 void ecs_remove_component(int id, Entity_t entity);
+// Adds the component to n entities that don't have it yet. They go in
+// one block at the end of the dense array, in the same order, so entity i
+// ends up at ecs_cl_at(id, first + i) where first is the return value.
+// data is an array of n components, NULL for zeroes. Archetype lists
+// return (Idx_t) -1, their components can be anywhere.
+Idx_t ecs_new_components(int id, const Entity_t *entities, uint32_t n, const void *data);
 
 Idx_t ecs_cl_count(int id);
 void* ecs_cl_at(int id, Idx_t index);
@@ -148,17 +670,204 @@ void* ecs_cl_at(int id, Idx_t index);
 void* ecs_cl_begin(int id);
 void* ecs_cl_next(int id, void *iter);
 
+// Struct-of-arrays access. A page has up to 1024 components, and columns
+// of the same page line up: row i of every column is the same entity.
+// Rows with a 0 entity are holes left by ecs_cl_keep_ordering().
+//     for (uint32_t p = 0; p < ecs_soa_page_count(MOVE_COMP); ++p) {
+//         uint32_t n;
+//         float *x = ecs_soa_column(MOVE_COMP, p, 0, &n);
+//         float *vx = ecs_soa_column(MOVE_COMP, p, 2, &n);
+//         floats_add_scaled(x, x, vx, dt, n);
+//     }
+uint32_t ecs_soa_page_count(int id);
+void* ecs_soa_column(int id, uint32_t page, int field, uint32_t *count);
+// NULL if the entity doesn't have the component
+void* ecs_soa_field(int id, Entity_t entity, int field);
+
+// Components can be changed in the loop, but not added or removed:
+//     int ids[] = { POS_COMP, VEL_COMP };
+//     Ecs_Query q;
+//     ecs_query_init(&q, ids, 2);
+//     while (ecs_query_next(&q)) {
+//         Position_Component *pos = q.components[0];
+//     }
+void ecs_query_init(Ecs_Query *self, const int *ids, int n_ids);
+bool ecs_query_next(Ecs_Query *self);
+// For queries where every list uses archetypes. Hands out a whole chunk
+// at once: components[i] points to an array of that many components.
+// Returns 0 when done.
+uint32_t ecs_query_next_chunk(Ecs_Query *self);
+// Starts over, picking the driver again
+void ecs_query_reset(Ecs_Query *self);
+
 // Flag sets
+// Lists that allow purging (the default) get purged at every scene switch.
+// Their dense pages come from the scene's arena while a scene is running,
+// so the switch frees them all at once. Other pages come from a pool in
+// the list's world, and get reused by any list with the same page size.
+// Set this before adding components, it fails once the list has pages.
 void ecs_cl_allow_purge(int id, bool allow);
 void ecs_cl_keep_ordering(int id, bool keep);
+// Entities with the same set of archetype lists get their components
+// stored together, in chunks with one column per component.
+// Walk these lists with queries, ecs_cl_at/begin/next don't work on them.
+// Set this before adding components.
+void ecs_cl_use_archetypes(int id, bool use);
 void ecs_cl_ordered_clean(int id);
 
+// Sorting
+// Reorders the dense array, so loops over it (or over a join of lists)
+// walk memory in order. Ties keep the order they were in. Sorting a list
+// that's mostly in order is cheap, and only the components out of place
+// move, so sorting every frame keeps a list in order as things change.
+// Holes left by ecs_cl_keep_ordering() get dropped.
+// Don't sort a list while walking it. Archetype lists can't be sorted.
+// They return how many components moved.
+typedef uint64_t (*Ecs_Sort_Key)(const void *component, void *arg);
+uint32_t ecs_cl_sort_by_entity(int id);
+// Like a spatial cell index, smallest first
+uint32_t ecs_cl_sort_by_key(int id, Ecs_Sort_Key key, void *arg);
+// Puts entities in the same order as in the other list, so a query over
+// both walks them side by side. Entities that aren't in the other list go
+// last.
+uint32_t ecs_cl_sort_like(int id, int like_id);
+
+// Change tracking
+// Components of tracked lists remember the frame they last changed in.
+// New components count as changed, other changes go through
+// ecs_write_component() or ecs_mark_changed().
+uint32_t ecs_frame(void);
+// Call it once per frame. Returns the new frame.
+uint32_t ecs_advance_frame(void);
+void ecs_cl_track_changes(int id, bool track);
+// Same as ecs_get_component(), but marks the component as changed
+void* ecs_write_component(int id, Entity_t entity);
+void ecs_mark_changed(int id, Entity_t entity);
+// Walks the components changed in since_frame or later. To see every
+// change exactly once, start the next walk at the frame after this one.
+void ecs_changes_begin(Ecs_Change_Iter *it, int id, uint32_t since_frame);
+bool ecs_changes_next(Ecs_Change_Iter *it);
+// Forgets the changes from before the given frame
+void ecs_cl_trim_changes(int id, uint32_t before_frame);
+
+// Command buffers
+// Adding/removing components and deleting entities can't happen while a
+// list is being walked, or from worker threads. These record the changes
+// instead, and apply them all at once later.
+void ecs_commands_init(Ecs_Command_Buffer *self);
+void ecs_commands_deinit(Ecs_Command_Buffer *self);
+// The entity can be used in this buffer's commands, but only gets
+// created when the buffer is applied
+Entity_t ecs_cmd_create(Ecs_Command_Buffer *self);
+// Copies the component data (NULL for zeroes)
+void ecs_cmd_add(Ecs_Command_Buffer *self, int id, Entity_t entity, const void *data);
+void ecs_cmd_remove(Ecs_Command_Buffer *self, int id, Entity_t entity);
+void ecs_cmd_delete(Ecs_Command_Buffer *self, Entity_t entity);
+// Sorts the commands by component list, so each list gets its changes in
+// one go. Only the last add/remove of a component per entity counts, and
+// deletes come last. Call it from the main thread.
+void ecs_commands_apply(Ecs_Command_Buffer **buffers, int n_buffers);
+
+// The calling thread's own buffer
+Ecs_Command_Buffer* ecs_thread_commands(void);
+// Applies every thread's buffer. ecs_scheduler_run() calls it at the end.
+void ecs_commands_sync(void);
+
+// Snapshots
+// Saves the entities and every component list's components. Restoring
+// needs the same component lists set up in the same way, and doesn't
+// touch the change tracking frames and logs.
+void ecs_snapshot_save(Ecs_Snapshot *self);
+void ecs_snapshot_restore(const Ecs_Snapshot *self);
+void ecs_snapshot_free(Ecs_Snapshot *self);
+
+// Systems
+// Every frame the systems get split into waves. A system goes in the first
+// wave after all of the earlier systems it conflicts with. The systems in
+// a wave run at the same time on the job system. Systems shouldn't add or
+// remove components while they run.
+void ecs_scheduler_init(Ecs_Scheduler *self, struct Job_System *jobs);
+void ecs_scheduler_deinit(Ecs_Scheduler *self);
+// Returns the system's index
+int ecs_system_add(Ecs_Scheduler *self, const Ecs_System_Desc *desc);
+void ecs_system_enable(Ecs_Scheduler *self, int index, bool enable);
+void ecs_scheduler_run(Ecs_Scheduler *self);
+
 // Entity manipulation
 Entity_t ecs_new_entity(void);
 void ecs_delete_entity(Entity_t entity);
+// Same as calling these n times, but each component list only gets
+// visited once
+void ecs_new_entities(Entity_t *out, uint32_t n);
+void ecs_delete_entities(const Entity_t *entities, uint32_t n);
+
+// Worlds
+// Everything above works on the default world. The ecs_w_ versions take
+// the world to work on, so separate simulations can each have their own
+// and run on different threads. One world shouldn't be used by two
+// threads at once, except through systems and command buffers.
+// Create and destroy worlds from one thread only.
+Ecs_World* ecs_world_create(void);
+void ecs_world_destroy(Ecs_World *w);
+Ecs_World* ecs_default_world(void);
+
+void ecs_w_cl_init_sz(Ecs_World *w, int id, unsigned int element_size);
+void ecs_w_cl_init_soa(Ecs_World *w, int id, const unsigned int *field_sizes, int n_fields);
+void ecs_w_cl_deinit(Ecs_World *w, int id);
+uint32_t ecs_w_frame(Ecs_World *w);
+uint32_t ecs_w_advance_frame(Ecs_World *w);
+void ecs_w_cl_track_changes(Ecs_World *w, int id, bool track);
+void ecs_w_mark_changed(Ecs_World *w, int id, Entity_t entity);
+void* ecs_w_write_component(Ecs_World *w, int id, Entity_t entity);
+void ecs_w_cl_trim_changes(Ecs_World *w, int id, uint32_t before_frame);
+void ecs_w_changes_begin(Ecs_World *w, Ecs_Change_Iter *it, int id, uint32_t since_frame);
+void* ecs_w_get_component_nullable(Ecs_World *w, int id, Entity_t entity);
+void* ecs_w_get_component(Ecs_World *w, int id, Entity_t entity);
+void* ecs_w_new_component(Ecs_World *w, int id, Entity_t entity);
+Idx_t ecs_w_new_components(Ecs_World *w, int id, const Entity_t *entities, uint32_t n, const void *data);
+void ecs_w_remove_component(Ecs_World *w, int id, Entity_t entity);
+void ecs_w_cl_ordered_clean(Ecs_World *w, int id);
+uint32_t ecs_w_cl_sort_by_entity(Ecs_World *w, int id);
+uint32_t ecs_w_cl_sort_by_key(Ecs_World *w, int id, Ecs_Sort_Key key, void *arg);
+uint32_t ecs_w_cl_sort_like(Ecs_World *w, int id, int like_id);
+Idx_t ecs_w_cl_count(Ecs_World *w, int id);
+void* ecs_w_cl_at(Ecs_World *w, int id, Idx_t index);
+void* ecs_w_cl_begin(Ecs_World *w, int id);
+void* ecs_w_cl_next(Ecs_World *w, int id, void *iter);
+uint32_t ecs_w_soa_page_count(Ecs_World *w, int id);
+void* ecs_w_soa_column(Ecs_World *w, int id, uint32_t page, int field, uint32_t *count);
+void* ecs_w_soa_field(Ecs_World *w, int id, Entity_t entity, int field);
+void ecs_w_query_init(Ecs_World *w, Ecs_Query *self, const int *ids, int n_ids);
+void ecs_w_cl_allow_purge(Ecs_World *w, int id, bool allow);
+void ecs_w_cl_keep_ordering(Ecs_World *w, int id, bool keep);
+void ecs_w_cl_use_archetypes(Ecs_World *w, int id, bool use);
+void ecs_w_commands_init(Ecs_World *w, Ecs_Command_Buffer *self);
+Ecs_Command_Buffer* ecs_w_thread_commands(Ecs_World *w);
+void ecs_w_commands_sync(Ecs_World *w);
+void ecs_w_scheduler_init(Ecs_World *w, Ecs_Scheduler *self, struct Job_System *jobs);
+void ecs_w_snapshot_save(Ecs_World *w, Ecs_Snapshot *self);
+void ecs_w_snapshot_restore(Ecs_World *w, const Ecs_Snapshot *self);
+void ecs_w_purge_cls(Ecs_World *w);
+Entity_t ecs_w_new_entity(Ecs_World *w);
+void ecs_w_new_entities(Ecs_World *w, Entity_t *out, uint32_t n);
+void ecs_w_delete_entity(Ecs_World *w, Entity_t entity);
+void ecs_w_delete_entities(Ecs_World *w, const Entity_t *entities, uint32_t n);
 
 #ifdef __cplusplus
 } // extern "C"
+
+#include <type_traits>
+
+// Same hash as scene_id(), but done by the compiler
+constexpr Scene_Id scene_id_const(const char *name, Scene_Id h = SCENE_ID_OFFSET)
+{
+    return *name ? scene_id_const(name + 1, (h ^ (uint8_t) *name) * SCENE_ID_PRIME)
+                 : (h ? h : 1);
+}
+
+#define SCENE_ID(name) (std::integral_constant<Scene_Id, scene_id_const(name)>::value)
+#else
+#define SCENE_ID(name) (scene_id(name))
 #endif
 
 #endif // SCENE_H_
@@ -1,6 +1,8 @@
 #include "item.h"
+#include "arena.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 // Item
@@ -76,11 +78,27 @@ void inventory_init(Inventory *self)
     self->count = 0;
     self->capacity = 0;
     self->slots = NULL;
+    self->arena = NULL;
+}
+
+void inventory_init_arena(Inventory *self, Arena *arena, uint32_t capacity)
+{
+    inventory_init(self);
+    self->arena = arena;
+    if (capacity) {
+        self->slots = arena_push_array(arena, Item_Stack, capacity);
+        self->capacity = capacity;
+    }
 }
 
 void inventory_free(Inventory *self)
 {
-    free(self->slots);
+    // Arena slots get freed with the arena
+    if (!self->arena) {
+        free(self->slots);
+    }
+    self->slots = NULL;
+    self->count = self->capacity = 0;
 }
 
 
@@ -95,9 +113,22 @@ Inventory inventory_create()
 void inventory_add_slot(Inventory *self, Item_Stack stack)
 {
     if (self->count >= self->capacity) {
-        //unsigned long long count = self->capacity ? self->capacity * 2 : 1;
-        unsigned long long count = 256;
-        self->slots = (Item_Stack *) malloc(count * sizeof(Item_Stack));
+        uint32_t count = self->capacity ? self->capacity * 2 : 16;
+        Item_Stack *slots;
+        if (self->arena) {
+            // The old slots stay in the arena until it's cleared
+            slots = arena_push_array_no_zero(self->arena, Item_Stack, count);
+            if (self->count) {
+                memcpy(slots, self->slots, self->count * sizeof(Item_Stack));
+            }
+        } else {
+            slots = (Item_Stack *) realloc(self->slots, count * sizeof(Item_Stack));
+        }
+        if (!slots) {
+            return;
+        }
+        self->slots = slots;
+        self->capacity = count;
     }
 
 
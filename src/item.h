@@ -46,6 +46,10 @@ typedef struct Inventory {
     Item_Stack *slots;
     uint32_t count;
     uint32_t capacity;
+
+    // If set, slots come from this arena and are freed along with it
+    // (e.g. the scene's arena)
+    struct Arena *arena;
 } Inventory;
 
 // A slice of an inventory's slots, basically like a "view",
@@ -93,6 +97,7 @@ void itemstack_copy(Item_Stack *src, Item_Stack *dest);
 
 void inventory_init(Inventory *self);
 Inventory inventory_create();
+void inventory_init_arena(Inventory *self, struct Arena *arena, uint32_t capacity);
 
 void inventory_free(Inventory *self);
 
@@ -0,0 +1,382 @@
+#include "jobs.h"
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// OS threads
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct OS_Thread_Start {
+    OS_Thread_Fn fn;
+    void *arg;
+} OS_Thread_Start;
+
+#if HAS_WINDOWS
+static DWORD WINAPI os_thread_entry(LPVOID param)
+#else
+static void* os_thread_entry(void *param)
+#endif
+{
+    OS_Thread_Start start = *(OS_Thread_Start *) param;
+    free(param);
+
+    start.fn(start.arg);
+    return 0;
+}
+
+void os_thread_create(OS_Thread *out, OS_Thread_Fn fn, void *arg)
+{
+    OS_Thread_Start *start = (OS_Thread_Start *) malloc(sizeof(OS_Thread_Start));
+    if (!start) {
+        FAIL_MESSAGE("Couldn't allocate memory for a new thread");
+    }
+    start->fn = fn;
+    start->arg = arg;
+
+#if HAS_WINDOWS
+    *out = CreateThread(NULL, 0, os_thread_entry, start, 0, NULL);
+    if (!*out) {
+        FAIL_MESSAGE("Couldn't create a thread");
+    }
+#else
+    if (pthread_create(out, NULL, os_thread_entry, start) != 0) {
+        FAIL_MESSAGE("Couldn't create a thread");
+    }
+#endif
+}
+
+void os_thread_join(OS_Thread thread)
+{
+#if HAS_WINDOWS
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+void os_mutex_init(OS_Mutex *m)
+{
+#if HAS_WINDOWS
+    InitializeCriticalSection(m);
+#else
+    pthread_mutex_init(m, NULL);
+#endif
+}
+
+void os_mutex_deinit(OS_Mutex *m)
+{
+#if HAS_WINDOWS
+    DeleteCriticalSection(m);
+#else
+    pthread_mutex_destroy(m);
+#endif
+}
+
+void os_mutex_lock(OS_Mutex *m)
+{
+#if HAS_WINDOWS
+    EnterCriticalSection(m);
+#else
+    pthread_mutex_lock(m);
+#endif
+}
+
+void os_mutex_unlock(OS_Mutex *m)
+{
+#if HAS_WINDOWS
+    LeaveCriticalSection(m);
+#else
+    pthread_mutex_unlock(m);
+#endif
+}
+
+void os_cond_init(OS_Cond *c)
+{
+#if HAS_WINDOWS
+    InitializeConditionVariable(c);
+#else
+    pthread_cond_init(c, NULL);
+#endif
+}
+
+void os_cond_deinit(OS_Cond *c)
+{
+#if HAS_WINDOWS
+    (void) c;
+#else
+    pthread_cond_destroy(c);
+#endif
+}
+
+void os_cond_wait(OS_Cond *c, OS_Mutex *m)
+{
+#if HAS_WINDOWS
+    SleepConditionVariableCS(c, m, INFINITE);
+#else
+    pthread_cond_wait(c, m);
+#endif
+}
+
+void os_cond_signal(OS_Cond *c)
+{
+#if HAS_WINDOWS
+    WakeConditionVariable(c);
+#else
+    pthread_cond_signal(c);
+#endif
+}
+
+void os_cond_broadcast(OS_Cond *c)
+{
+#if HAS_WINDOWS
+    WakeAllConditionVariable(c);
+#else
+    pthread_cond_broadcast(c);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Job system
+///////////////////////////////////////////////////////////////////////////////
+
+// Takes the first queued job. If a counter is given, only a job from that
+// group gets taken, so a waiting thread doesn't get stuck running
+// somebody else's long job. Expects the mutex to be locked.
+static bool jobs_pop(Job_System *self, Job_Counter *only, Job *out)
+{
+    for (uint32_t i = 0; i < self->count; ++i) {
+        uint32_t idx = (self->head + i) % self->capacity;
+        if (only && self->queue[idx].counter != only) {
+            continue;
+        }
+
+        *out = self->queue[idx];
+        // Fill the hole with the head job
+        self->queue[idx] = self->queue[self->head];
+        self->head = (self->head + 1) % self->capacity;
+        self->count--;
+        return true;
+    }
+    return false;
+}
+
+static void jobs_run(Job_System *self, Job *job)
+{
+    job->fn(job->arg);
+
+    if (job->counter) {
+        os_mutex_lock(&self->mutex);
+        if (--job->counter->pending == 0) {
+            os_cond_broadcast(&self->done);
+        }
+        os_mutex_unlock(&self->mutex);
+    }
+}
+
+static void jobs_worker(void *arg)
+{
+    Job_System *self = (Job_System *) arg;
+
+    // Jobs may want scratch arenas
+    arena_system_init();
+
+    os_mutex_lock(&self->mutex);
+    while (true) {
+        Job job;
+        if (jobs_pop(self, NULL, &job)) {
+            os_mutex_unlock(&self->mutex);
+            jobs_run(self, &job);
+            os_mutex_lock(&self->mutex);
+        } else if (self->quit) {
+            break;
+        } else {
+            os_cond_wait(&self->wake, &self->mutex);
+        }
+    }
+    os_mutex_unlock(&self->mutex);
+
+    arena_system_deinit();
+}
+
+void jobs_init(Job_System *self, uint32_t thread_count)
+{
+    if (!self) {
+        return;
+    }
+    memset(self, 0, sizeof(*self));
+
+    if (thread_count == JOBS_AUTO_THREADS) {
+        OS_System_Info *info;
+        os_get_system_info(&info);
+        thread_count = info->logical_processor_count > 1 ? info->logical_processor_count - 1 : 0;
+    }
+
+    self->capacity = JOBS_DEFAULT_QUEUE_SIZE;
+    self->queue = (Job *) malloc(sizeof(Job) * self->capacity);
+    if (!self->queue) {
+        FAIL_MESSAGE("Couldn't allocate the job queue");
+    }
+
+    os_mutex_init(&self->mutex);
+    os_cond_init(&self->wake);
+    os_cond_init(&self->done);
+
+    self->thread_count = thread_count;
+    if (thread_count) {
+        self->threads = (OS_Thread *) malloc(sizeof(OS_Thread) * thread_count);
+        if (!self->threads) {
+            FAIL_MESSAGE("Couldn't allocate the worker threads");
+        }
+        for (uint32_t i = 0; i < thread_count; ++i) {
+            os_thread_create(&self->threads[i], jobs_worker, self);
+        }
+    }
+}
+
+void jobs_deinit(Job_System *self)
+{
+    if (!self || !self->queue) {
+        return;
+    }
+
+    os_mutex_lock(&self->mutex);
+    self->quit = true;
+    os_cond_broadcast(&self->wake);
+    os_mutex_unlock(&self->mutex);
+
+    // Workers finish whatever is still queued before quitting
+    for (uint32_t i = 0; i < self->thread_count; ++i) {
+        os_thread_join(self->threads[i]);
+    }
+
+    os_cond_deinit(&self->done);
+    os_cond_deinit(&self->wake);
+    os_mutex_deinit(&self->mutex);
+
+    free(self->threads);
+    free(self->queue);
+    memset(self, 0, sizeof(*self));
+}
+
+void jobs_submit(Job_System *self, Job_Fn fn, void *arg, Job_Counter *counter)
+{
+    if (!self->thread_count && !counter) {
+        // Nobody would ever run it
+        fn(arg);
+        return;
+    }
+
+    os_mutex_lock(&self->mutex);
+
+    if (self->count == self->capacity) {
+        // Unwrap the ring into a bigger array
+        uint32_t capacity = self->capacity * 2;
+        Job *queue = (Job *) malloc(sizeof(Job) * capacity);
+        if (!queue) {
+            FAIL_MESSAGE("Couldn't grow the job queue");
+        }
+        for (uint32_t i = 0; i < self->count; ++i) {
+            queue[i] = self->queue[(self->head + i) % self->capacity];
+        }
+        free(self->queue);
+        self->queue = queue;
+        self->capacity = capacity;
+        self->head = 0;
+    }
+
+    Job *job = &self->queue[(self->head + self->count) % self->capacity];
+    job->fn = fn;
+    job->arg = arg;
+    job->counter = counter;
+    self->count++;
+
+    if (counter) {
+        counter->pending++;
+    }
+
+    os_cond_signal(&self->wake);
+    os_mutex_unlock(&self->mutex);
+}
+
+void jobs_wait(Job_System *self, Job_Counter *counter)
+{
+    if (!counter) {
+        return;
+    }
+
+    os_mutex_lock(&self->mutex);
+    while (counter->pending) {
+        Job job;
+        if (jobs_pop(self, counter, &job)) {
+            // Help out instead of sleeping
+            os_mutex_unlock(&self->mutex);
+            jobs_run(self, &job);
+            os_mutex_lock(&self->mutex);
+        } else {
+            os_cond_wait(&self->done, &self->mutex);
+        }
+    }
+    os_mutex_unlock(&self->mutex);
+}
+
+#define JOBS_LOCAL_RANGES 64
+
+static void jobs_run_range(void *arg)
+{
+    Job_Range *range = (Job_Range *) arg;
+    range->fn(range->arg, range->begin, range->end);
+}
+
+void jobs_parallel_for(Job_System *self, uint32_t count, uint32_t batch_size,
+    Job_Range_Fn fn, void *arg)
+{
+    if (count == 0) {
+        return;
+    }
+
+    if (batch_size == 0) {
+        // A few batches per thread, so uneven batches even out
+        uint32_t pieces = jobs_thread_count(self) * 4;
+        batch_size = (count + pieces - 1) / pieces;
+    }
+
+    uint32_t n_ranges = (count + batch_size - 1) / batch_size;
+    if (n_ranges == 1 || self->thread_count == 0) {
+        fn(arg, 0, count);
+        return;
+    }
+
+    // Each call has its own ranges, on the stack unless there are lots
+    Job_Range local[JOBS_LOCAL_RANGES];
+    Job_Range *ranges = local;
+    if (n_ranges > JOBS_LOCAL_RANGES) {
+        ranges = (Job_Range *) malloc(sizeof(Job_Range) * n_ranges);
+        if (!ranges) {
+            FAIL_MESSAGE("Couldn't allocate job ranges");
+        }
+    }
+
+    Job_Counter counter = { 0 };
+    for (uint32_t i = 0; i < n_ranges; ++i) {
+        Job_Range *range = &ranges[i];
+        range->fn = fn;
+        range->arg = arg;
+        range->begin = i * batch_size;
+        range->end = MIN(count, range->begin + batch_size);
+        jobs_submit(self, jobs_run_range, range, &counter);
+    }
+    jobs_wait(self, &counter);
+
+    if (ranges != local) {
+        free(ranges);
+    }
+}
+
+uint32_t jobs_thread_count(Job_System *self)
+{
+    return self->thread_count + 1;
+}
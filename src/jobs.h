@@ -0,0 +1,136 @@
+#ifndef JOBS_H_
+#define JOBS_H_ 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// A fixed pool of worker threads sharing one job queue.
+//
+// Jobs are a function pointer and an argument. Jobs can be grouped with a
+// counter, so the caller can wait on just the jobs it submitted.
+// A thread that waits also runs jobs from its own group in the meantime,
+// instead of sleeping.
+//
+// With 0 worker threads, jobs run on the calling thread: in jobs_wait(), or
+// right away in jobs_submit() for jobs without a counter, since nobody waits
+// on those.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+#if HAS_WINDOWS
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// OS threads
+///////////////////////////////////////////////////////////////////////////////
+
+#if HAS_WINDOWS
+typedef HANDLE OS_Thread;
+typedef CRITICAL_SECTION OS_Mutex;
+typedef CONDITION_VARIABLE OS_Cond;
+#else
+typedef pthread_t OS_Thread;
+typedef pthread_mutex_t OS_Mutex;
+typedef pthread_cond_t OS_Cond;
+#endif
+
+typedef void (*OS_Thread_Fn)(void *arg);
+
+void os_thread_create(OS_Thread *out, OS_Thread_Fn fn, void *arg);
+void os_thread_join(OS_Thread thread);
+
+void os_mutex_init(OS_Mutex *m);
+void os_mutex_deinit(OS_Mutex *m);
+void os_mutex_lock(OS_Mutex *m);
+void os_mutex_unlock(OS_Mutex *m);
+
+void os_cond_init(OS_Cond *c);
+void os_cond_deinit(OS_Cond *c);
+void os_cond_wait(OS_Cond *c, OS_Mutex *m);
+void os_cond_signal(OS_Cond *c);
+void os_cond_broadcast(OS_Cond *c);
+
+///////////////////////////////////////////////////////////////////////////////
+// Job system
+///////////////////////////////////////////////////////////////////////////////
+
+#define JOBS_DEFAULT_QUEUE_SIZE 256
+
+typedef void (*Job_Fn)(void *arg);
+// Gets one piece [begin, end) of a range that got split up
+typedef void (*Job_Range_Fn)(void *arg, uint32_t begin, uint32_t end);
+
+// Counts the jobs of a group that haven't finished yet
+typedef struct Job_Counter {
+    uint32_t pending;
+} Job_Counter;
+
+typedef struct Job {
+    Job_Fn fn;
+    void *arg;
+    Job_Counter *counter;
+} Job;
+
+typedef struct Job_Range {
+    Job_Range_Fn fn;
+    void *arg;
+    uint32_t begin;
+    uint32_t end;
+} Job_Range;
+
+typedef struct Job_System {
+    OS_Thread *threads;
+    uint32_t thread_count;
+
+    OS_Mutex mutex;
+    OS_Cond wake; // A job got queued, or we're quitting
+    OS_Cond done; // A job with a counter finished
+
+    // Ring buffer of queued jobs, grows when it's full
+    Job *queue;
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;
+
+    bool quit;
+} Job_System;
+
+
+// One worker for each logical processor, except for the calling thread
+#define JOBS_AUTO_THREADS ((uint32_t) -1)
+
+void jobs_init(Job_System *self, uint32_t thread_count);
+void jobs_deinit(Job_System *self);
+
+// The counter can be NULL for jobs that nobody waits on
+void jobs_submit(Job_System *self, Job_Fn fn, void *arg, Job_Counter *counter);
+// Waits until every job in the counter's group is done
+void jobs_wait(Job_System *self, Job_Counter *counter);
+
+// Splits [0, count) into pieces of at most batch_size (0 picks one),
+// runs them on the workers and waits for all of them.
+// Calls can overlap, or be made from inside fn.
+void jobs_parallel_for(Job_System *self, uint32_t count, uint32_t batch_size,
+    Job_Range_Fn fn, void *arg);
+
+// Workers + the calling thread
+uint32_t jobs_thread_count(Job_System *self);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // JOBS_H_
@@ -4,12 +4,18 @@
 #include "gamedev.h"
 #include "gamedev.c"
 
+#include "jobs.h"
+#include "jobs.c"
+
 #include "item.h"
 #include "item.c"
 
 #include "log.h"
 #include "log.c"
 
+#include "world.h"
+#include "world.c"
+
 
 #include <stdio.h>
 #include <unistd.h>
@@ -75,7 +75,7 @@ Vec4f* vec4_lerp(Vec4f* out, const Vec4f* a, const Vec4f*b, float t)
 }
 
 // Use 4 SIMD Instructions for 4 vectors in a matrix
-Mat4f* mat_copy(Mat4f* out, const Mat4f* a)
+Mat4f* mat4_copy(Mat4f* out, const Mat4f* a)
 {
     _mm_store_ps(&out->c[0], _mm_load_ps(&a->c[0]));
     _mm_store_ps(&out->c[4], _mm_load_ps(&a->c[4]));
@@ -84,48 +84,71 @@ Mat4f* mat_copy(Mat4f* out, const Mat4f* a)
     return out;
 }
 
-Mat4f* mat4_mul(Mat4f *out, const Mat4f *a, const Mat4f *b)
+// Each column of out is a's columns scaled by that column of b, added up.
+// b gets loaded first, so out can be a or b.
+static inline void mat4_mul_sse(float *out, const float *a, const float *b)
 {
     // Temporary SIMD registers
     __m128 l, r0, r1, r2, r3,
               v0, v1, v2, v3;
 
-    r0 = _mm_load_ps(&b->c[0]);
-    r1 = _mm_load_ps(&b->c[4]);
-    r2 = _mm_load_ps(&b->c[8]);
-    r3 = _mm_load_ps(&b->c[12]);
+    r0 = _mm_load_ps(&b[0]);
+    r1 = _mm_load_ps(&b[4]);
+    r2 = _mm_load_ps(&b[8]);
+    r3 = _mm_load_ps(&b[12]);
 
-    l = _mm_load_ps(&a->c[0]);
+    l = _mm_load_ps(&a[0]);
     v0 = _mm_mul_ps(l, splat_x(r0));
     v1 = _mm_mul_ps(l, splat_x(r1));
     v2 = _mm_mul_ps(l, splat_x(r2));
     v3 = _mm_mul_ps(l, splat_x(r3));
 
-    l = _mm_load_ps(&a->c[4]);
-    v0 = _mm_mul_ps(l, _mm_mul_ps(l, splat_y(r0)));
-    v1 = _mm_mul_ps(l, _mm_mul_ps(l, splat_y(r1)));
-    v2 = _mm_mul_ps(l, _mm_mul_ps(l, splat_y(r2)));
-    v3 = _mm_mul_ps(l, _mm_mul_ps(l, splat_y(r3)));
-
-    l = _mm_load_ps(&a->c[8]);
-    v0 = _mm_mul_ps(l, _mm_mul_ps(l, splat_z(r0)));
-    v1 = _mm_mul_ps(l, _mm_mul_ps(l, splat_z(r1)));
-    v2 = _mm_mul_ps(l, _mm_mul_ps(l, splat_z(r2)));
-    v3 = _mm_mul_ps(l, _mm_mul_ps(l, splat_z(r3)));
-
-    l = _mm_load_ps(&a->c[12]);
-    v0 = _mm_mul_ps(l, _mm_mul_ps(l, splat_z(r0)));
-    v1 = _mm_mul_ps(l, _mm_mul_ps(l, splat_z(r1)));
-    v2 = _mm_mul_ps(l, _mm_mul_ps(l, splat_z(r2)));
-    v3 = _mm_mul_ps(l, _mm_mul_ps(l, splat_z(r3)));
-
-    _mm_store_ps(&out->c[0], v0);
-    _mm_store_ps(&out->c[4], v1);
-    _mm_store_ps(&out->c[8], v2);
-    _mm_store_ps(&out->c[12], v3);
+    l = _mm_load_ps(&a[4]);
+    v0 = _mm_add_ps(v0, _mm_mul_ps(l, splat_y(r0)));
+    v1 = _mm_add_ps(v1, _mm_mul_ps(l, splat_y(r1)));
+    v2 = _mm_add_ps(v2, _mm_mul_ps(l, splat_y(r2)));
+    v3 = _mm_add_ps(v3, _mm_mul_ps(l, splat_y(r3)));
+
+    l = _mm_load_ps(&a[8]);
+    v0 = _mm_add_ps(v0, _mm_mul_ps(l, splat_z(r0)));
+    v1 = _mm_add_ps(v1, _mm_mul_ps(l, splat_z(r1)));
+    v2 = _mm_add_ps(v2, _mm_mul_ps(l, splat_z(r2)));
+    v3 = _mm_add_ps(v3, _mm_mul_ps(l, splat_z(r3)));
+
+    l = _mm_load_ps(&a[12]);
+    v0 = _mm_add_ps(v0, _mm_mul_ps(l, splat_w(r0)));
+    v1 = _mm_add_ps(v1, _mm_mul_ps(l, splat_w(r1)));
+    v2 = _mm_add_ps(v2, _mm_mul_ps(l, splat_w(r2)));
+    v3 = _mm_add_ps(v3, _mm_mul_ps(l, splat_w(r3)));
+
+    _mm_store_ps(&out[0], v0);
+    _mm_store_ps(&out[4], v1);
+    _mm_store_ps(&out[8], v2);
+    _mm_store_ps(&out[12], v3);
+}
+
+Mat4f* mat4_mul(Mat4f *out, const Mat4f *a, const Mat4f *b)
+{
+    mat4_mul_sse(out->c, a->c, b->c);
     return out;
 }
 
+// The matrices are usually all over memory, so the next ones get
+// fetched while the current one gets multiplied. A matrix is only 16-byte
+// aligned, so it can straddle 2 cache lines: fetch its first and last byte.
+void mat4_mul_batch(Mat4f** out, const Mat4f** a, const Mat4f** b, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; ++i) {
+        if (i + 1 < n) {
+            _mm_prefetch((const char *) a[i + 1], _MM_HINT_T0);
+            _mm_prefetch((const char *) a[i + 1] + sizeof(Mat4f) - 1, _MM_HINT_T0);
+            _mm_prefetch((const char *) b[i + 1], _MM_HINT_T0);
+            _mm_prefetch((const char *) b[i + 1] + sizeof(Mat4f) - 1, _MM_HINT_T0);
+        }
+        mat4_mul_sse(out[i]->c, a[i]->c, b[i]->c);
+    }
+}
+
 Vec4f* mat4_mul_vec4(Vec4f* out, const Mat4f* a, const Vec4f* b)
 {
     __m128 r = _mm_loadu_ps(&b->x);
@@ -150,6 +173,21 @@ Vec4f* mat4_mul_vec3(Vec4f* out, const Mat4f* a, Vec4f* b)
     return mat4_mul_vec4(out, a, b);
 }
 
+// 4 floats per instruction, then the leftovers one by one
+float* floats_add_scaled(float* out, const float* a, const float* b, float s, unsigned int n)
+{
+    __m128 sv = _mm_set_ps1(s);
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_add_ps(_mm_load_ps(&a[i]), _mm_mul_ps(_mm_load_ps(&b[i]), sv));
+        _mm_store_ps(&out[i], v);
+    }
+    for (; i < n; ++i) {
+        out[i] = a[i] + b[i] * s;
+    }
+    return out;
+}
+
 #else
 #error "No SSE found for compatibility"
 #endif
@@ -187,9 +187,17 @@ Vec4f* vec4_lerp(Vec4f* out, const Vec4f* a, const Vec4f* b, float t);
 Mat4f* mat4_copy(Mat4f* out, const Mat4f* a);
 
 Mat4f* mat4_mul(Mat4f* out, const Mat4f* a, const Mat4f* b);
+// out[i] = a[i] * b[i], for matrices that aren't next to each other.
+// Every matrix has to be 16-byte aligned.
+void mat4_mul_batch(Mat4f** out, const Mat4f** a, const Mat4f** b, unsigned int n);
 Vec4f* mat4_mul_vec4(Vec4f* out, const Mat4f* a, const Vec4f* b);
 Vec4f* mat4_mul_vec3(Vec4f* out, const Mat4f* a, Vec4f* b);
 
+// Whole float arrays at once, like the columns of struct-of-arrays
+// components. They have to be 16-byte aligned.
+// out[i] = a[i] + b[i] * s, out can be a
+float* floats_add_scaled(float* out, const float* a, const float* b, float s, unsigned int n);
+
 ///////////////////////////////////////////////////////////////////////////////
 // Frontend functions
 ///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,229 @@
+#include "transform.h"
+#include "arena.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Dense pages are 16-byte aligned, so the matrices of every component are
+// too, as long as these hold
+STATIC_ASSERT(sizeof(Transform_Component) % 16 == 0, transform_size_is_16_aligned);
+STATIC_ASSERT(offsetof(Transform_Component, local) % 16 == 0, transform_local_is_16_aligned);
+
+#define TRANSFORM_NO_DEPTH ((uint32_t) -1)
+
+static Transform_Component* transform_get(Transform_System *self, Entity_t entity)
+{
+    return (Transform_Component *) ecs_w_get_component_nullable(self->world, self->id, entity);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Setup
+///////////////////////////////////////////////////////////////////////////////
+
+void transform_system_init(Transform_System *self, Ecs_World *world, int id)
+{
+    memset(self, 0, sizeof(*self));
+    self->world = world ? world : ecs_default_world();
+    self->id = id;
+
+    ecs_w_cl_init_sz(self->world, id, sizeof(Transform_Component));
+    // Removing a transform leaves a hole instead of moving the last one in
+    // front of its parent. The holes go away at the next sort.
+    ecs_w_cl_keep_ordering(self->world, id, true);
+}
+
+void transform_system_deinit(Transform_System *self)
+{
+    ecs_w_cl_deinit(self->world, self->id);
+    free(self->stack);
+    free(self->batch_out);
+    free(self->batch_parent);
+    free(self->batch_local);
+    memset(self, 0, sizeof(*self));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Transforms
+///////////////////////////////////////////////////////////////////////////////
+
+Transform_Component* transform_add(Transform_System *self, Entity_t entity, Entity_t parent)
+{
+    Transform_Component *t = (Transform_Component *) ecs_w_new_component(self->world, self->id, entity);
+    t->parent = parent;
+    t->depth = 0;
+    t->updated = 0;
+    mat4_ident(&t->local, 1.0f);
+    mat4_ident(&t->world, 1.0f);
+
+    // It went in at the end, after every depth
+    self->reorder = true;
+    return t;
+}
+
+void transform_remove(Transform_System *self, Entity_t entity)
+{
+    ecs_w_remove_component(self->world, self->id, entity);
+    self->reorder = true;
+}
+
+void transform_set_parent(Transform_System *self, Entity_t entity, Entity_t parent)
+{
+    if (entity == parent) {
+        FAIL_MESSAGE("Couldn't make entity %x its own parent", entity);
+    }
+    Transform_Component *t = (Transform_Component *) ecs_w_get_component(self->world, self->id, entity);
+    t->parent = parent;
+    t->updated = 0;
+    self->reorder = true;
+}
+
+Mat4f* transform_write_local(Transform_System *self, Entity_t entity)
+{
+    Transform_Component *t = (Transform_Component *) ecs_w_get_component(self->world, self->id, entity);
+    t->updated = 0;
+    return &t->local;
+}
+
+const Mat4f* transform_world(Transform_System *self, Entity_t entity)
+{
+    Transform_Component *t = (Transform_Component *) ecs_w_get_component(self->world, self->id, entity);
+    return &t->world;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Update
+///////////////////////////////////////////////////////////////////////////////
+
+static void transform_reserve(Transform_System *self, uint32_t count)
+{
+    if (count <= self->batch_capacity) {
+        return;
+    }
+    free(self->stack);
+    free(self->batch_out);
+    free(self->batch_parent);
+    free(self->batch_local);
+    self->stack = (Transform_Component **) malloc(sizeof(Transform_Component *) * count);
+    self->batch_out = (Mat4f **) malloc(sizeof(Mat4f *) * count);
+    self->batch_parent = (const Mat4f **) malloc(sizeof(Mat4f *) * count);
+    self->batch_local = (const Mat4f **) malloc(sizeof(Mat4f *) * count);
+    if (!self->stack || !self->batch_out || !self->batch_parent || !self->batch_local) {
+        FAIL_MESSAGE("Couldn't allocate memory for %u transforms", count);
+    }
+    self->batch_capacity = count;
+}
+
+// Walks up from each transform to the first one that has its depth, then
+// hands depths out on the way back down, so each one gets done once
+static void transform_fix_depths(Transform_System *self, uint32_t count)
+{
+    for (Idx_t i = 0; i < count; ++i) {
+        Transform_Component *t = (Transform_Component *) ecs_w_cl_at(self->world, self->id, i);
+        t->depth = TRANSFORM_NO_DEPTH;
+    }
+
+    for (Idx_t i = 0; i < count; ++i) {
+        Transform_Component *t = (Transform_Component *) ecs_w_cl_at(self->world, self->id, i);
+        if (!t->entity || t->depth != TRANSFORM_NO_DEPTH) {
+            continue;
+        }
+
+        uint32_t n_stack = 0;
+        Transform_Component *up = t;
+        while (up && up->depth == TRANSFORM_NO_DEPTH) {
+            if (n_stack == count) {
+                FAIL_MESSAGE("The transform of entity %x is its own ancestor", t->entity);
+            }
+            self->stack[n_stack++] = up;
+
+            Transform_Component *parent = up->parent ? transform_get(self, up->parent) : NULL;
+            if (up->parent && !parent) {
+                // The parent went away, it's a root now
+                up->parent = 0;
+                up->updated = 0;
+            }
+            up = parent;
+        }
+
+        uint32_t depth = up ? up->depth + 1 : 0;
+        while (n_stack) {
+            self->stack[--n_stack]->depth = depth++;
+        }
+    }
+}
+
+static uint64_t transform_depth_key(const void *component, void *arg)
+{
+    (void) arg;
+    return ((const Transform_Component *) component)->depth;
+}
+
+static void transform_flush(Transform_System *self, uint32_t *n_batch)
+{
+    mat4_mul_batch(self->batch_out, self->batch_parent, self->batch_local, *n_batch);
+    *n_batch = 0;
+}
+
+uint32_t transform_update(Transform_System *self)
+{
+    Ecs_World *w = self->world;
+    uint32_t count = ecs_w_cl_count(w, self->id);
+    transform_reserve(self, count);
+
+    if (self->reorder) {
+        transform_fix_depths(self, count);
+        ecs_w_cl_sort_by_key(w, self->id, transform_depth_key, NULL);
+        count = ecs_w_cl_count(w, self->id);
+        self->reorder = false;
+    }
+
+    // 0 is for the ones that have to change
+    if (++self->update == 0) {
+        self->update = 1;
+    }
+
+    // Parents come before their children. Transforms at the same depth
+    // don't depend on each other, so a batch goes until the depth changes.
+    uint32_t changed = 0;
+    uint32_t n_batch = 0;
+    uint32_t batch_depth = 0;
+    for (Idx_t i = 0; i < count; ++i) {
+        Transform_Component *t = (Transform_Component *) ecs_w_cl_at(w, self->id, i);
+        if (!t->entity) {
+            continue;
+        }
+
+        Transform_Component *parent = t->parent ? transform_get(self, t->parent) : NULL;
+        if (t->parent && !parent) {
+            // The parent's entity got deleted. Its children have bigger
+            // depths, so they still don't go in the same batch as this.
+            t->parent = 0;
+            t->depth = 0;
+            t->updated = 0;
+            self->reorder = true;
+        }
+
+        if (t->depth != batch_depth) {
+            transform_flush(self, &n_batch);
+            batch_depth = t->depth;
+        }
+
+        if (!parent) {
+            if (t->updated == 0) {
+                mat4_copy(&t->world, &t->local);
+                t->updated = self->update;
+                changed++;
+            }
+        } else if (t->updated == 0 || parent->updated == self->update) {
+            self->batch_out[n_batch] = &t->world;
+            self->batch_parent[n_batch] = &parent->world;
+            self->batch_local[n_batch] = &t->local;
+            n_batch++;
+            t->updated = self->update;
+            changed++;
+        }
+    }
+    transform_flush(self, &n_batch);
+    return changed;
+}
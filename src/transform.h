@@ -0,0 +1,78 @@
+#ifndef TRANSFORM_H_
+#define TRANSFORM_H_ 1
+
+///////////////////////////////////////////////////////////////////////////////
+// Transform hierarchy, on top of the ECS.
+//
+// Each transform has a local matrix, relative to its parent, and a world
+// matrix that transform_update() computes as parent world * local.
+//
+// The component list stays sorted by depth, so parents always come before
+// their children and the update is one walk over the dense array. Only
+// transforms whose local matrix changed, and everything under them, get
+// recomputed. The ones at the same depth get multiplied in one batch.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gamedev.h"
+#include "mathf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Transform_Component {
+    Entity_t entity;
+    // 0 for roots
+    Entity_t parent;
+    uint32_t depth;
+    // The update that last changed the world matrix, 0 if it has to change
+    uint32_t updated;
+
+    // Both are 16-byte aligned, for the SSE math
+    Mat4f local;
+    Mat4f world;
+} Transform_Component;
+
+typedef struct Transform_System {
+    Ecs_World *world;
+    int id;
+    uint32_t update;
+    // A parent changed, so the depths and the order need fixing
+    bool reorder;
+
+    // Scratch for walking up to the roots, and for the batches.
+    // They all hold batch_capacity pointers.
+    Transform_Component **stack;
+    Mat4f **batch_out;
+    const Mat4f **batch_parent;
+    const Mat4f **batch_local;
+    uint32_t batch_capacity;
+} Transform_System;
+
+// Sets up the component list at index id, in the given world (NULL for the
+// default one). The list is an ordinary one, so its flags can still be set.
+void transform_system_init(Transform_System *self, Ecs_World *world, int id);
+void transform_system_deinit(Transform_System *self);
+
+// The local matrix starts as the identity. parent can be 0.
+Transform_Component* transform_add(Transform_System *self, Entity_t entity, Entity_t parent);
+// Children of a removed transform become roots at the next update
+void transform_remove(Transform_System *self, Entity_t entity);
+void transform_set_parent(Transform_System *self, Entity_t entity, Entity_t parent);
+
+// Marks the transform as changed, and returns its local matrix to write to
+Mat4f* transform_write_local(Transform_System *self, Entity_t entity);
+// As of the last update
+const Mat4f* transform_world(Transform_System *self, Entity_t entity);
+
+// Recomputes the world matrices that changed. Returns how many did.
+uint32_t transform_update(Transform_System *self);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // TRANSFORM_H_
@@ -0,0 +1,499 @@
+#include "world.h"
+#include "arena.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WORLD_EMPTY_SLOT ((uint32_t) -1)
+
+///////////////////////////////////////////////////////////////////////////////
+// Chunk table
+///////////////////////////////////////////////////////////////////////////////
+
+static uint32_t world_hash(World_Chunk_Coord coord)
+{
+    uint32_t h = (uint32_t) coord.x * 73856093u;
+    h ^= (uint32_t) coord.y * 19349663u;
+    h ^= (uint32_t) coord.z * 83492791u;
+    // Mix the high bits down, since the table gets masked
+    h ^= h >> 16;
+    h *= 0x45d9f3bu;
+    h ^= h >> 16;
+    return h;
+}
+
+static bool world_coord_eq(World_Chunk_Coord a, World_Chunk_Coord b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+static World_Chunk* world_find(World_Stream *self, World_Chunk_Coord coord)
+{
+    uint32_t mask = self->table_capacity - 1;
+    for (uint32_t i = world_hash(coord) & mask; ; i = (i + 1) & mask) {
+        uint32_t idx = self->table[i];
+        if (idx == WORLD_EMPTY_SLOT) {
+            return NULL;
+        }
+        if (world_coord_eq(self->chunks[idx].coord, coord)) {
+            return &self->chunks[idx];
+        }
+    }
+}
+
+// NULL if every chunk is taken
+static World_Chunk* world_new_chunk(World_Stream *self, World_Chunk_Coord coord)
+{
+    if (!self->n_free) {
+        return NULL;
+    }
+    uint32_t idx = self->free_list[--self->n_free];
+
+    World_Chunk *chunk = &self->chunks[idx];
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->coord = coord;
+    chunk->state = CHUNK_QUEUED;
+    chunk->world = self;
+
+    uint32_t mask = self->table_capacity - 1;
+    uint32_t i = world_hash(coord) & mask;
+    while (self->table[i] != WORLD_EMPTY_SLOT) {
+        i = (i + 1) & mask;
+    }
+    self->table[i] = idx;
+    return chunk;
+}
+
+static void world_free_chunk(World_Stream *self, World_Chunk *chunk)
+{
+    uint32_t idx = (uint32_t) (chunk - self->chunks);
+    uint32_t mask = self->table_capacity - 1;
+
+    uint32_t i = world_hash(chunk->coord) & mask;
+    while (self->table[i] != idx) {
+        i = (i + 1) & mask;
+    }
+
+    // Backward shift deletion, so lookups never need tombstones
+    uint32_t hole = i;
+    for (uint32_t j = (i + 1) & mask; self->table[j] != WORLD_EMPTY_SLOT; j = (j + 1) & mask) {
+        uint32_t home = world_hash(self->chunks[self->table[j]].coord) & mask;
+        // Move the entry back if its home slot isn't between the hole and it
+        bool movable = (hole <= j) ? (home <= hole || home > j) : (home <= hole && home > j);
+        if (movable) {
+            self->table[hole] = self->table[j];
+            hole = j;
+        }
+    }
+    self->table[hole] = WORLD_EMPTY_SLOT;
+
+    chunk->state = CHUNK_UNLOADED;
+    self->free_list[self->n_free++] = idx;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Priority queue
+///////////////////////////////////////////////////////////////////////////////
+
+static float world_heap_key(World_Stream *self, uint32_t i)
+{
+    return self->chunks[self->heap[i]].distance;
+}
+
+static void world_heap_down(World_Stream *self, uint32_t i)
+{
+    while (true) {
+        uint32_t left = i * 2 + 1, right = left + 1, smallest = i;
+        if (left < self->heap_count && world_heap_key(self, left) < world_heap_key(self, smallest)) {
+            smallest = left;
+        }
+        if (right < self->heap_count && world_heap_key(self, right) < world_heap_key(self, smallest)) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        uint32_t tmp = self->heap[i];
+        self->heap[i] = self->heap[smallest];
+        self->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static void world_heap_push(World_Stream *self, World_Chunk *chunk)
+{
+    uint32_t i = self->heap_count++;
+    self->heap[i] = (uint32_t) (chunk - self->chunks);
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (world_heap_key(self, parent) <= world_heap_key(self, i)) {
+            break;
+        }
+        uint32_t tmp = self->heap[i];
+        self->heap[i] = self->heap[parent];
+        self->heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+static World_Chunk* world_heap_pop(World_Stream *self)
+{
+    World_Chunk *top = &self->chunks[self->heap[0]];
+    self->heap[0] = self->heap[--self->heap_count];
+    world_heap_down(self, 0);
+    return top;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Loading and unloading
+///////////////////////////////////////////////////////////////////////////////
+
+// Distance from the chunk's center to the closest focus, in chunks
+static float world_focus_distance(World_Stream *self, World_Chunk_Coord coord)
+{
+    float best = INFINITY;
+    float inv = 1.0f / self->desc.chunk_size;
+
+    for (int i = 0; i < WORLD_MAX_FOCUS; ++i) {
+        World_Focus *f = &self->focus[i];
+        if (!f->active) {
+            continue;
+        }
+        float dx = (float) coord.x + 0.5f - f->x * inv;
+        float dy = self->desc.flat ? 0.0f : (float) coord.y + 0.5f - f->y * inv;
+        float dz = (float) coord.z + 0.5f - f->z * inv;
+        best = MIN(best, dx * dx + dy * dy + dz * dz);
+    }
+    return sqrtf(best);
+}
+
+// Runs on a worker
+static void world_load_job(void *arg)
+{
+    World_Chunk *chunk = (World_Chunk *) arg;
+    World_Stream *self = chunk->world;
+
+    chunk->arena = arena_alloc();
+    if (self->desc.load) {
+        chunk->data = self->desc.load(self->desc.arg, chunk->arena, chunk->coord);
+    }
+    ATOMIC_STORE_32(&chunk->state, CHUNK_LOADED);
+}
+
+static void world_unload(World_Stream *self, World_Chunk *chunk)
+{
+    if (chunk->state == CHUNK_ACTIVE) {
+        if (self->desc.deactivate) {
+            self->desc.deactivate(self->desc.arg, chunk);
+        }
+        self->memory_used -= chunk->memory;
+        self->n_active--;
+    }
+    if (chunk->arena) {
+        arena_release(chunk->arena);
+    }
+    world_free_chunk(self, chunk);
+}
+
+// What the chunk's arena actually holds on to, which is more than what got
+// pushed: blocks are committed in steps, and chained blocks keep their
+// leftover space
+static uint64_t world_arena_committed(Arena *arena)
+{
+    uint64_t committed = 0;
+    for (Arena *n = arena->current; n != NULL; n = n->prev) {
+        committed += n->commit_pos;
+    }
+    for (Arena *n = arena->free_last; n != NULL; n = n->prev) {
+        committed += n->commit_pos;
+    }
+    return committed;
+}
+
+static void world_finish_load(World_Stream *self, World_Chunk *chunk)
+{
+    self->in_flight--;
+    if (chunk->cancelled) {
+        world_unload(self, chunk);
+        return;
+    }
+
+    chunk->memory = world_arena_committed(chunk->arena);
+    chunk->state = CHUNK_ACTIVE;
+    self->memory_used += chunk->memory;
+    self->n_active++;
+
+    if (self->desc.activate) {
+        self->desc.activate(self->desc.arg, chunk);
+    }
+}
+
+static void world_finish_loads(World_Stream *self)
+{
+    for (uint32_t i = 0; i < self->desc.max_chunks; ++i) {
+        World_Chunk *chunk = &self->chunks[i];
+        if (ATOMIC_LOAD_32(&chunk->state) == CHUNK_LOADED) {
+            world_finish_load(self, chunk);
+        }
+    }
+}
+
+static World_Chunk* world_farthest_active(World_Stream *self)
+{
+    World_Chunk *farthest = NULL;
+    for (uint32_t i = 0; i < self->desc.max_chunks; ++i) {
+        World_Chunk *chunk = &self->chunks[i];
+        if (chunk->state == CHUNK_ACTIVE && (!farthest || chunk->distance > farthest->distance)) {
+            farthest = chunk;
+        }
+    }
+    return farthest;
+}
+
+// Returns false when there are no chunks left, max_chunks is too small for
+// the radius then
+static bool world_queue_focus(World_Stream *self, const World_Focus *focus)
+{
+    int32_t r = (int32_t) ceilf(self->desc.load_radius);
+    float inv = 1.0f / self->desc.chunk_size;
+
+    int32_t cx = (int32_t) floorf(focus->x * inv);
+    int32_t cy = self->desc.flat ? 0 : (int32_t) floorf(focus->y * inv);
+    int32_t cz = (int32_t) floorf(focus->z * inv);
+    int32_t ry = self->desc.flat ? 0 : r;
+
+    for (int32_t y = cy - ry; y <= cy + ry; ++y)
+    for (int32_t z = cz - r; z <= cz + r; ++z)
+    for (int32_t x = cx - r; x <= cx + r; ++x) {
+        World_Chunk_Coord coord = { x, y, z };
+        float distance = world_focus_distance(self, coord);
+        if (distance > self->desc.load_radius || world_find(self, coord)) {
+            continue;
+        }
+
+        World_Chunk *chunk = world_new_chunk(self, coord);
+        if (!chunk) {
+            return false;
+        }
+        chunk->distance = distance;
+        world_heap_push(self, chunk);
+    }
+    return true;
+}
+
+static void world_start_loads(World_Stream *self)
+{
+    bool threaded = self->jobs && self->jobs->thread_count;
+
+    while (self->heap_count && self->in_flight < self->desc.max_loads_in_flight) {
+        World_Chunk *next = &self->chunks[self->heap[0]];
+
+        if (self->desc.memory_budget && self->n_active) {
+            // Guess that the loads in flight are about as big as the chunks we have
+            uint64_t average = self->memory_used / self->n_active;
+            uint64_t expected = self->memory_used + average * (self->in_flight + 1);
+            if (expected > self->desc.memory_budget) {
+                // Only make room by dropping a chunk that's farther away,
+                // otherwise the 2 would keep swapping places
+                World_Chunk *farthest = world_farthest_active(self);
+                if (!farthest || farthest->distance <= next->distance) {
+                    break;
+                }
+                world_unload(self, farthest);
+                continue;
+            }
+        }
+
+        world_heap_pop(self);
+        next->state = CHUNK_LOADING;
+        self->in_flight++;
+
+        if (threaded) {
+            jobs_submit(self->jobs, world_load_job, next, &self->loads);
+        } else {
+            world_load_job(next);
+            world_finish_load(self, next);
+        }
+    }
+}
+
+// Waits for the loads in flight, then unloads every chunk
+static void world_unload_all(World_Stream *self)
+{
+    if (self->jobs) {
+        jobs_wait(self->jobs, &self->loads);
+    }
+    for (uint32_t i = 0; i < self->desc.max_chunks; ++i) {
+        World_Chunk *chunk = &self->chunks[i];
+        if (chunk->state != CHUNK_UNLOADED) {
+            world_unload(self, chunk);
+        }
+    }
+    self->heap_count = 0;
+    self->in_flight = 0;
+}
+
+// The stream stays up, and loads around the focus points again at the
+// next update
+static void world_on_scene_end(void *arg, Event_t *ev)
+{
+    (void) ev;
+    world_unload_all((World_Stream *) arg);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// World streaming
+///////////////////////////////////////////////////////////////////////////////
+
+void world_stream_init(World_Stream *self, Job_System *jobs, const World_Stream_Desc *desc)
+{
+    if (!self || !desc) {
+        return;
+    }
+    memset(self, 0, sizeof(*self));
+    self->desc = *desc;
+    self->jobs = jobs;
+
+    if (self->desc.chunk_size <= 0.0f) {
+        FAIL_MESSAGE("World chunks need a positive size");
+    }
+    if (self->desc.unload_radius < self->desc.load_radius) {
+        self->desc.unload_radius = self->desc.load_radius;
+    }
+    if (!self->desc.max_chunks) {
+        self->desc.max_chunks = WORLD_DEFAULT_MAX_CHUNKS;
+    }
+    if (!self->desc.max_loads_in_flight) {
+        self->desc.max_loads_in_flight = jobs ? jobs_thread_count(jobs) : 1;
+    }
+
+    uint32_t max_chunks = self->desc.max_chunks;
+    // At most half full, so probes stay short
+    self->table_capacity = 1;
+    while (self->table_capacity < max_chunks * 2) {
+        self->table_capacity <<= 1;
+    }
+
+    self->chunks = (World_Chunk *) calloc(max_chunks, sizeof(World_Chunk));
+    self->free_list = (uint32_t *) malloc(sizeof(uint32_t) * max_chunks);
+    self->heap = (uint32_t *) malloc(sizeof(uint32_t) * max_chunks);
+    self->table = (uint32_t *) malloc(sizeof(uint32_t) * self->table_capacity);
+    if (!self->chunks || !self->free_list || !self->heap || !self->table) {
+        FAIL_MESSAGE("Couldn't allocate the world chunk tables");
+    }
+    memset(self->table, 0xFF, sizeof(uint32_t) * self->table_capacity);
+
+    // Hand out the low indices first
+    for (uint32_t i = 0; i < max_chunks; ++i) {
+        self->free_list[i] = max_chunks - 1 - i;
+    }
+    self->n_free = max_chunks;
+
+    if (self->desc.end_with_scene) {
+        self->scene_cb.input = world_on_scene_end;
+        self->scene_cb.arg = self;
+        self->scene_cb.type_mask = EVENT_END_SCENE;
+        events_subscribe(scene_handlers(), self->scene_cb);
+    }
+    self->initialized = true;
+}
+
+void world_stream_deinit(World_Stream *self)
+{
+    if (!self || !self->initialized) {
+        return;
+    }
+
+    world_unload_all(self);
+    if (self->desc.end_with_scene) {
+        events_unsubscribe(scene_handlers(), self->scene_cb);
+    }
+
+    free(self->chunks);
+    free(self->free_list);
+    free(self->heap);
+    free(self->table);
+    memset(self, 0, sizeof(*self));
+}
+
+void world_stream_set_focus(World_Stream *self, int index, float x, float y, float z)
+{
+    if (index < 0 || index >= WORLD_MAX_FOCUS) {
+        return;
+    }
+    World_Focus *f = &self->focus[index];
+    f->x = x;
+    f->y = y;
+    f->z = z;
+    f->active = true;
+}
+
+void world_stream_clear_focus(World_Stream *self, int index)
+{
+    if (index < 0 || index >= WORLD_MAX_FOCUS) {
+        return;
+    }
+    self->focus[index].active = false;
+}
+
+void world_stream_update(World_Stream *self)
+{
+    if (!self || !self->initialized) {
+        return;
+    }
+
+    world_finish_loads(self);
+
+    // Refresh distances, drop what's out of range and requeue the rest,
+    // since the focus points may have moved
+    self->heap_count = 0;
+    for (uint32_t i = 0; i < self->desc.max_chunks; ++i) {
+        World_Chunk *chunk = &self->chunks[i];
+        uint32_t state = ATOMIC_LOAD_32(&chunk->state);
+        if (state == CHUNK_UNLOADED) {
+            continue;
+        }
+
+        chunk->distance = world_focus_distance(self, chunk->coord);
+        bool far = chunk->distance > self->desc.unload_radius;
+
+        if (state == CHUNK_LOADING || state == CHUNK_LOADED) {
+            // Can't touch it until the worker is done
+            chunk->cancelled = far;
+        } else if (far) {
+            world_unload(self, chunk);
+        } else if (state == CHUNK_QUEUED) {
+            self->heap[self->heap_count++] = i;
+        }
+    }
+    for (uint32_t i = self->heap_count / 2; i-- > 0; ) {
+        world_heap_down(self, i);
+    }
+
+    // Queue up the missing chunks around each focus
+    for (int f = 0; f < WORLD_MAX_FOCUS; ++f) {
+        if (self->focus[f].active && !world_queue_focus(self, &self->focus[f])) {
+            break;
+        }
+    }
+
+    world_start_loads(self);
+}
+
+World_Chunk* world_stream_chunk_at(World_Stream *self, float x, float y, float z)
+{
+    if (!self || !self->initialized) {
+        return NULL;
+    }
+
+    float inv = 1.0f / self->desc.chunk_size;
+    World_Chunk_Coord coord = {
+        (int32_t) floorf(x * inv),
+        self->desc.flat ? 0 : (int32_t) floorf(y * inv),
+        (int32_t) floorf(z * inv),
+    };
+    World_Chunk *chunk = world_find(self, coord);
+    return (chunk && chunk->state == CHUNK_ACTIVE) ? chunk : NULL;
+}
@@ -0,0 +1,152 @@
+#ifndef WORLD_H_
+#define WORLD_H_ 1
+
+///////////////////////////////////////////////////////////////////////////////
+// World streaming, on top of the scene system.
+//
+// The world is cut into a grid of chunks. Chunks around one or more focus
+// points get loaded, and chunks that are far from all of them get unloaded.
+//
+// Loading happens in 2 steps:
+// - load() runs on a worker thread, and builds the chunk's content
+//   (entity data, bodies, items) into the chunk's own arena
+// - activate() runs on the main thread, in world_stream_update(), and puts
+//   that content into the world (the ECS, the physics world...)
+// Unloading calls deactivate() on the main thread, then frees the chunk's
+// arena in one go.
+//
+// The closest chunks load first. Loading stops at the memory budget,
+// unless there's a farther chunk that can be unloaded to make room.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "jobs.h"
+#include "gamedev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WORLD_MAX_FOCUS 8
+#define WORLD_DEFAULT_MAX_CHUNKS 1024
+
+typedef struct World_Chunk_Coord {
+    int32_t x, y, z;
+} World_Chunk_Coord;
+
+typedef enum World_Chunk_State {
+    CHUNK_UNLOADED = 0,
+    // Waiting in the priority queue
+    CHUNK_QUEUED,
+    // A worker is building it
+    CHUNK_LOADING,
+    // Built, waiting to be activated on the main thread
+    CHUNK_LOADED,
+    // In the world
+    CHUNK_ACTIVE,
+} World_Chunk_State;
+
+struct World_Stream;
+
+typedef struct World_Chunk {
+    World_Chunk_Coord coord;
+    // Set to CHUNK_LOADED by the worker
+    uint32_t state;
+    // Distance to the closest focus point, in chunks
+    float distance;
+
+    struct Arena *arena;
+    void *data;
+    // Committed by its arena, which is what counts against the budget
+    uint64_t memory;
+
+    // Went out of range while a worker was loading it
+    bool cancelled;
+    struct World_Stream *world;
+} World_Chunk;
+
+typedef struct World_Stream_Desc {
+    float chunk_size;
+    // In chunks. Chunks get unloaded past unload_radius, which should be
+    // bigger than load_radius so chunks don't flicker at the edge.
+    float load_radius;
+    float unload_radius;
+    // Chunks only spread on x and z
+    bool flat;
+
+    // In bytes, 0 for no limit
+    uint64_t memory_budget;
+    // 0 picks WORLD_DEFAULT_MAX_CHUNKS
+    uint32_t max_chunks;
+    // 0 picks the job system's thread count
+    uint32_t max_loads_in_flight;
+    // Without a job system (or without workers), chunks load right away
+    // inside world_stream_update()
+
+    // Runs on a worker thread. Returns the chunk's data.
+    void* (*load)(void *arg, struct Arena *arena, World_Chunk_Coord coord);
+    // Both run on the main thread. They can be NULL.
+    void (*activate)(void *arg, World_Chunk *chunk);
+    void (*deactivate)(void *arg, World_Chunk *chunk);
+    void *arg;
+
+    // Unload every chunk when a scene ends. The stream stays initialized,
+    // and loads around its focus points again at the next update.
+    bool end_with_scene;
+} World_Stream_Desc;
+
+typedef struct World_Focus {
+    float x, y, z;
+    bool active;
+} World_Focus;
+
+typedef struct World_Stream {
+    World_Stream_Desc desc;
+    Job_System *jobs;
+    bool initialized;
+
+    World_Focus focus[WORLD_MAX_FOCUS];
+
+    // Chunks never move, because workers hold pointers to them
+    World_Chunk *chunks;
+    uint32_t *free_list;
+    uint32_t n_free;
+
+    // Coordinate -> chunk index, open addressing
+    uint32_t *table;
+    uint32_t table_capacity;
+
+    // Min-heap of queued chunks, by distance
+    uint32_t *heap;
+    uint32_t heap_count;
+
+    Job_Counter loads;
+    uint32_t in_flight;
+    uint32_t n_active;
+    uint64_t memory_used;
+
+    Event_Callback scene_cb;
+} World_Stream;
+
+void world_stream_init(World_Stream *self, Job_System *jobs, const World_Stream_Desc *desc);
+// Waits for the loads in flight, and unloads every chunk
+void world_stream_deinit(World_Stream *self);
+
+void world_stream_set_focus(World_Stream *self, int index, float x, float y, float z);
+void world_stream_clear_focus(World_Stream *self, int index);
+
+// Call it once per frame, from the main thread
+void world_stream_update(World_Stream *self);
+
+// NULL if the chunk isn't active
+World_Chunk* world_stream_chunk_at(World_Stream *self, float x, float y, float z);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // WORLD_H_